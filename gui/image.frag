@@ -2,6 +2,16 @@ out vec4 frag_color;
 
 uniform sampler2DRect s_texture;
 
+// Shared float accumulation buffer and per-pixel sample counts
+uniform sampler2DRect s_accum;
+uniform sampler2DRect s_count;
+uniform bool float_buffer;
+uniform float igamma;
+
+// Low resolution preview, used where the image has no samples yet
+uniform sampler2DRect s_preview;
+uniform float preview_scale;
+
 uniform vec2 wsize;
 uniform vec2 off;
 uniform float zoom;
@@ -10,13 +20,32 @@ layout(origin_upper_left) in vec4 gl_FragCoord;
 
 void main(void)
 {
-    vec2 tsize = textureSize(s_texture);
+    vec2 tsize = float_buffer ? textureSize(s_accum) : textureSize(s_texture);
     vec2 coord = (gl_FragCoord.xy - wsize + off) / zoom;
     coord += tsize/2;
     if (coord.x >= 0.0 && coord.x <= tsize.x &&
         coord.y >= 0.0 && coord.y <= tsize.y)
     {
-        frag_color = texture(s_texture, coord);
+        bool rendered;
+        if (float_buffer)
+        {
+            float count = texture(s_count, coord).r;
+            vec3 clr = texture(s_accum, coord).rgb;
+            clr /= max(count, 1.0);
+            clr = min(pow(max(clr, vec3(0.0)), vec3(igamma)), vec3(1.0));
+            frag_color = vec4(clr, 1);
+            rendered = count > 0.0;
+        }
+        else
+        {
+            frag_color = texture(s_texture, coord);
+            rendered = frag_color.a > 0.0;
+        }
+
+        if (!rendered && preview_scale > 0.0)
+        {
+            frag_color = vec4(texture(s_preview, coord / preview_scale).rgb, 1);
+        }
     }
     else if (coord.x >= -1.0/zoom && coord.x <= tsize.x+1.0/zoom &&
              coord.y >= -1.0/zoom && coord.y <= tsize.y+1.0/zoom)
@@ -54,6 +54,7 @@ MAIN_WINDOW::MAIN_WINDOW(const char *progname, const char *filename)
         }
         m_json_ui = nlohmann::json::parse(ss);
     }
+    m_renderview->set_ui(m_json_ui);
 
     auto layout = new QGridLayout;
     auto params = new QWidget;
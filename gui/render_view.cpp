@@ -10,7 +10,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <climits>
 #include <sstream>
+#include <algorithm>
+#include <atomic>
 
 
 RENDER_VIEW::RENDER_VIEW(QGLFormat fmt,
@@ -21,7 +24,6 @@ RENDER_VIEW::RENDER_VIEW(QGLFormat fmt,
     , m_statusbar(status)
     , m_program(0)
     , m_texture(0)
-    , m_pbuffer(0)
 {
     // Extract the path to the executable
     m_path = progname;
@@ -170,9 +172,58 @@ bool RENDER_VIEW::update_render()
         m_shm_data = nullptr;
     }
 
-    std::ostringstream oss;
-    oss << m_updates;
-    std::string str = oss.str();
+    // Numeric updates, such as a slider being dragged, are sent in binary
+    // to save the renderer parsing them
+    PARAM_UPDATE header;
+    std::vector<PARAM_VALUE> values;
+    bool binary = true;
+    auto add_value = [&](int id, int component, const nlohmann::json &value)
+    {
+        if (!value.is_number() && !value.is_boolean())
+        {
+            binary = false;
+            return;
+        }
+        PARAM_VALUE v;
+        v.id = id;
+        v.component = component;
+        v.value = value.is_boolean() ? (double)value.get<bool>() : value.get<double>();
+        values.push_back(v);
+    };
+    for (const auto &p : m_updates.items())
+    {
+        auto it = m_parameter_ids.find(p.key());
+        if (it == m_parameter_ids.end())
+        {
+            binary = false;
+            break;
+        }
+        if (p.value().is_array())
+        {
+            for (size_t i = 0; i < p.value().size(); i++)
+            {
+                add_value(it->second, i, p.value()[i]);
+            }
+        }
+        else
+        {
+            add_value(it->second, 0, p.value());
+        }
+    }
+
+    std::string str;
+    if (binary)
+    {
+        header.count = values.size();
+        str.assign((const char *)&header, sizeof(PARAM_UPDATE));
+        str.append((const char *)values.data(), values.size()*sizeof(PARAM_VALUE));
+    }
+    else
+    {
+        std::ostringstream oss;
+        oss << m_updates;
+        str = oss.str();
+    }
     if (write(m_outjson_fd, str.c_str(), str.size()) < 0)
     {
         return false;
@@ -194,36 +245,24 @@ bool RENDER_VIEW::handshake_render()
 
     // Map shared memory after reading m_res, since at this point we know the
     // child process has created the shared buffer
+    // Writable only for the cancel flag
     m_shm_data = (uint*)mmap(NULL, m_res.shm_size(),
-            PROT_READ, MAP_SHARED, m_shm_fd, 0);
+            PROT_READ | PROT_WRITE, MAP_SHARED, m_shm_fd, 0);
     if (m_shm_data == MAP_FAILED)
     {
         perror("mmap");
         return false;
     }
 
-    // Create the tile queue for the first sample
-    TILE tile;
-    for (tile.yoff = 0; tile.yoff < m_res.yres; tile.yoff += m_res.tres)
-    {
-        for (tile.xoff = 0; tile.xoff < m_res.xres; tile.xoff += m_res.tres)
-        {
-            tile.xsize = std::min(m_res.xres - tile.xoff, m_res.tres);
-            tile.ysize = std::min(m_res.yres - tile.yoff, m_res.tres);
-            m_tiles.push(tile);
-        }
-    }
-    m_tiles_outstanding = 0;
-
     m_image.resize(m_res.xres, m_res.yres);
-    m_image_dirty = true;
+    mark_dirty();
 
-    // Queue up the initial tiles
-    for (int i = 0; i < m_res.nthreads; i++)
-    {
-        send_tile(i);
-    }
+    // The previous image stays on display until the first preview tile
+    m_clear_on_preview = m_res.preview_scale > 0;
+
+    m_rendering = true;
     m_samples_complete = 0;
+    std::fill(m_rays_complete, m_rays_complete + 3, 0);
     m_start_time = 0;
 
     // Set the read fd to nonblocking for the notifier callback
@@ -250,14 +289,14 @@ void RENDER_VIEW::stop_render()
         ::close(m_intile_fd);  m_intile_fd = -1;
         ::close(m_outtile_fd); m_outtile_fd = -1;
 
-        m_tiles = std::queue<TILE>();
-        m_tiles_outstanding = 0;
+        m_rendering = false;
         m_start_time = 0;
     }
 }
 
 void RENDER_VIEW::store_snapshot()
 {
+    resolve_image();
     m_snapshot = m_image;
     m_snapshot_dirty = true;
 }
@@ -273,7 +312,7 @@ void RENDER_VIEW::toggle_snapshot()
         }
         else
         {
-            m_image_dirty = true;
+            mark_dirty();
         }
         update();
     }
@@ -342,7 +381,7 @@ RENDER_VIEW::initializeGL()
     glDisable(GL_DITHER);
 
     // Create the memory state texture
-    glGenBuffers(1, &m_pbuffer);
+    glGenBuffers(s_pbuffer_count, m_pbuffers);
 
     glActiveTexture(GL_TEXTURE0);
     glGenTextures(1, &m_texture);
@@ -351,6 +390,27 @@ RENDER_VIEW::initializeGL()
     glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
+    glActiveTexture(GL_TEXTURE1);
+    glGenTextures(1, &m_accum_texture);
+    glBindTexture(GL_TEXTURE_RECTANGLE, m_accum_texture);
+    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glActiveTexture(GL_TEXTURE2);
+    glGenTextures(1, &m_count_texture);
+    glBindTexture(GL_TEXTURE_RECTANGLE, m_count_texture);
+    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // The preview is magnified with filtering
+    glActiveTexture(GL_TEXTURE3);
+    glGenTextures(1, &m_preview_texture);
+    glBindTexture(GL_TEXTURE_RECTANGLE, m_preview_texture);
+    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
     std::vector<std::string> paths;
     paths.push_back("");
     paths.push_back(m_path);
@@ -419,50 +479,211 @@ static double current_time()
     return ts.tv_sec + (1e-9 * (double)ts.tv_nsec);
 }
 
+void RENDER_VIEW::mark_dirty(const QRect &rect)
+{
+    m_dirty_rects.push_back(rect);
+    m_image_dirty = true;
+}
+
+void RENDER_VIEW::mark_dirty()
+{
+    mark_dirty(QRect(0, 0, m_res.xres, m_res.yres));
+}
+
+std::vector<QRect> RENDER_VIEW::dirty_rects()
+{
+    // Upload the whole image once the tiles cover much of it, which
+    // saves many small transfers
+    std::vector<QRect> rects;
+    std::swap(rects, m_dirty_rects);
+
+    QRect bounds(0, 0, m_res.xres, m_res.yres);
+    size_t area = 0;
+    for (auto &rect : rects)
+    {
+        rect &= bounds;
+        area += (size_t)rect.width()*rect.height();
+    }
+    if (area*2 >= m_res.pixel_count())
+    {
+        rects.assign(1, bounds);
+    }
+    return rects;
+}
+
+// Allocate the storage of a texture only when its size changes, so that
+// updates can use glTexSubImage2D
+static void resize_texture(GLuint texture, QSize &size, int width, int height,
+                           GLint internal_format, GLenum format, GLenum type)
+{
+    glBindTexture(GL_TEXTURE_RECTANGLE, texture);
+    if (size != QSize(width, height))
+    {
+        glTexImage2D(GL_TEXTURE_RECTANGLE, 0, internal_format,
+                width, height, 0, format, type, 0);
+        size = QSize(width, height);
+    }
+}
+
+void RENDER_VIEW::upload_image(const RASTER<uint32_t> &image, const std::vector<QRect> &rects)
+{
+    glActiveTexture(GL_TEXTURE0);
+    resize_texture(m_texture, m_texture_size, image.width(), image.height(),
+                   GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE);
+
+    size_t bytes = 0;
+    for (const auto &rect : rects)
+    {
+        bytes += (size_t)rect.width()*rect.height()*sizeof(uint32_t);
+    }
+    if (!bytes)
+    {
+        return;
+    }
+
+    // Cycle through the buffers and orphan the storage, so that the copy
+    // never waits for an earlier transfer still reading from it
+    m_pbuffer_index = (m_pbuffer_index + 1) % s_pbuffer_count;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbuffers[m_pbuffer_index]);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, 0, GL_STREAM_DRAW);
+
+    char *data = (char *)glMapBufferARB(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+    assert(data);
+
+    // Pack each rectangle contiguously
+    size_t offset = 0;
+    for (const auto &rect : rects)
+    {
+        const uint32_t *src = image.data() + (size_t)rect.y()*image.width() + rect.x();
+        for (int y = 0; y < rect.height(); y++)
+        {
+            memcpy(data + offset, src + (size_t)y*image.width(), rect.width()*sizeof(uint32_t));
+            offset += rect.width()*sizeof(uint32_t);
+        }
+    }
+
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    offset = 0;
+    for (const auto &rect : rects)
+    {
+        glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, rect.x(), rect.y(),
+                rect.width(), rect.height(), GL_RGBA,
+                GL_UNSIGNED_BYTE, (const char *)0 + offset /* offset in PBO */);
+        offset += (size_t)rect.width()*rect.height()*sizeof(uint32_t);
+    }
+
+    // Unbind the buffer - this is required for text rendering to work
+    // correctly.
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+// Attempts at reading a pixel of the float buffer while the renderer is
+// writing it
+static const int s_pixel_read_attempts = 16;
+
+// Read a pixel of the shared float buffer, which the renderer may be
+// updating. The renderer negates the count while it writes the color and
+// stores the new count with release once the color is complete, so the
+// color matches the count if the count is unchanged across the read.
+static void read_float_pixel(const float *accum, const float *counts, size_t i,
+                             float *color, float &count)
+{
+    const std::atomic<float> *shared_count = (const std::atomic<float> *)(counts + i);
+    for (int attempt = 0; attempt < s_pixel_read_attempts; attempt++)
+    {
+        float before = shared_count->load(std::memory_order_acquire);
+        for (int c = 0; c < 3; c++)
+        {
+            color[c] = accum[3*i+c];
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (before >= 0 && shared_count->load(std::memory_order_relaxed) == before)
+        {
+            count = before;
+            return;
+        }
+    }
+
+    // Still being written, so show it as unrendered until its tile is
+    // uploaded again
+    color[0] = color[1] = color[2] = 0;
+    count = 0;
+}
+
+void RENDER_VIEW::upload_float_buffer(const std::vector<QRect> &rects)
+{
+    // The shader normalizes by the sample counts and applies gamma
+    const float *accum = (const float *)m_shm_data;
+    const float *counts = (const float *)((const char *)m_shm_data + m_res.samples_offset());
+
+    glActiveTexture(GL_TEXTURE1);
+    resize_texture(m_accum_texture, m_accum_size, m_res.xres, m_res.yres,
+                   GL_RGB32F, GL_RGB, GL_FLOAT);
+    glActiveTexture(GL_TEXTURE2);
+    resize_texture(m_count_texture, m_count_size, m_res.xres, m_res.yres,
+                   GL_R32F, GL_RED, GL_FLOAT);
+
+    for (const auto &rect : rects)
+    {
+        size_t pixels = (size_t)rect.width()*rect.height();
+        m_accum_staging.resize(3*pixels);
+        m_count_staging.resize(pixels);
+        size_t j = 0;
+        for (int y = rect.y(); y < rect.y() + rect.height(); y++)
+        {
+            for (int x = rect.x(); x < rect.x() + rect.width(); x++, j++)
+            {
+                read_float_pixel(accum, counts, (size_t)y*m_res.xres + x,
+                                 &m_accum_staging[3*j], m_count_staging[j]);
+            }
+        }
+
+        glActiveTexture(GL_TEXTURE1);
+        glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, rect.x(), rect.y(),
+                rect.width(), rect.height(), GL_RGB, GL_FLOAT, m_accum_staging.data());
+        glActiveTexture(GL_TEXTURE2);
+        glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, rect.x(), rect.y(),
+                rect.width(), rect.height(), GL_RED, GL_FLOAT, m_count_staging.data());
+    }
+}
+
 void
 RENDER_VIEW::paintGL()
 {
-    const RASTER<uint32_t> *image = nullptr;
+    bool float_buffer = !m_snapshot_active && m_res.float_buffer && m_shm_data;
     if (m_snapshot_active)
     {
         if (m_snapshot_dirty)
         {
-            image = &m_snapshot;
+            std::vector<QRect> full(1, QRect(0, 0, m_snapshot.width(), m_snapshot.height()));
+            upload_image(m_snapshot, full);
             m_snapshot_dirty = false;
         }
     }
-    else
+    else if (m_image_dirty)
     {
-        if (m_image_dirty)
+        std::vector<QRect> rects = dirty_rects();
+        if (float_buffer)
+        {
+            upload_float_buffer(rects);
+        }
+        else
         {
-            image = &m_image;
-            m_image_dirty = false;
+            upload_image(m_image, rects);
         }
+        m_image_dirty = false;
     }
 
-    if (image)
+    bool preview = !m_snapshot_active && m_res.preview_scale && m_shm_data;
+    if (preview && m_preview_dirty)
     {
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbuffer);
-
-        glBufferData(GL_PIXEL_UNPACK_BUFFER, image->bytes(), 0, GL_STREAM_DRAW);
-
-        uint32_t *data = (uint32_t *)glMapBufferARB(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
-        assert(data);
-
-        memcpy(data, image->data(), image->bytes());
-
-        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_RECTANGLE, m_texture);
-
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_RECTANGLE, m_preview_texture);
         glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA,
-                image->width(), image->height(), 0, GL_RGBA,
-                GL_UNSIGNED_BYTE, 0 /* offset in PBO */);
-
-        // Unbind the buffer - this is required for text rendering to work
-        // correctly.
-        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                m_res.preview_xres(), m_res.preview_yres(), 0, GL_RGBA,
+                GL_UNSIGNED_BYTE, (const char *)m_shm_data + m_res.preview_offset());
+        m_preview_dirty = false;
     }
 
     if (m_program)
@@ -470,6 +691,12 @@ RENDER_VIEW::paintGL()
         m_program->bind();
 
         m_program->setUniformValue("s_texture", 0);
+        m_program->setUniformValue("s_accum", 1);
+        m_program->setUniformValue("s_count", 2);
+        m_program->setUniformValue("s_preview", 3);
+        m_program->setUniformValue("preview_scale", preview ? (GLfloat)m_res.preview_scale : 0.0F);
+        m_program->setUniformValue("float_buffer", (GLint)float_buffer);
+        m_program->setUniformValue("igamma", m_res.igamma);
         m_program->setUniformValue("wsize", QSize(width()/2, height()/2));
         m_program->setUniformValue("off", m_offset);
         m_program->setUniformValue("zoom", m_zoom);
@@ -545,6 +772,17 @@ RENDER_VIEW::paintGL()
                 oss << std::fixed << std::setprecision(2) << msamples_per_second;
                 perf_str += oss.str().c_str();
                 perf_str += " Msamples/s";
+
+                // Ray throughput with the share of reflection and shadow
+                // rays, which along with the time and rays shading modes
+                // shows where the render time goes
+                size_t rays = m_rays_complete[0] + m_rays_complete[1] + m_rays_complete[2];
+                oss.str("");
+                oss << "  " << rays / ((t - m_start_time) * 1e6) << " Mrays/s ("
+                    << std::setprecision(0)
+                    << m_rays_complete[1] * 100.0 / std::max(rays, (size_t)1) << "% reflection, "
+                    << m_rays_complete[2] * 100.0 / std::max(rays, (size_t)1) << "% shadow)";
+                perf_str += oss.str().c_str();
             }
             renderText(width()-metrics.width(perf_str)-tx, ty, perf_str, font);
         }
@@ -574,7 +812,8 @@ RENDER_VIEW::mousePressEvent(QMouseEvent *event)
 {
     if (event->button() == Qt::LeftButton)
     {
-        // TODO: Reorder tiles
+        m_presspos = event->pos();
+        m_panned = false;
     }
 }
 
@@ -585,6 +824,10 @@ RENDER_VIEW::mouseMoveEvent(QMouseEvent *event)
     if (event->buttons() & Qt::LeftButton)
     {
         m_offset += m_mousepos - currpos;
+        if ((currpos - m_presspos).manhattanLength() >= QApplication::startDragDistance())
+        {
+            m_panned = true;
+        }
 
         update();
     }
@@ -594,8 +837,20 @@ RENDER_VIEW::mouseMoveEvent(QMouseEvent *event)
 void
 RENDER_VIEW::mouseReleaseEvent(QMouseEvent *event)
 {
-    if (event->button() == Qt::LeftButton)
+    // The left button also pans, so only a click without panning focuses
+    if (event->button() == Qt::LeftButton && !m_panned && m_outtile_fd >= 0)
     {
+        // Render the tiles around the clicked image pixel first, using the
+        // same mapping as image.frag
+        QPoint pos = (event->pos() - QPoint(width()/2, height()/2) + m_offset) / m_zoom;
+        REQUEST request;
+        request.type = REQUEST::FOCUS;
+        request.x = pos.x() + m_res.xres/2;
+        request.y = pos.y() + m_res.yres/2;
+        if (write(m_outtile_fd, &request, sizeof(REQUEST)) < 0)
+        {
+            perror("write failed");
+        }
     }
 }
 
@@ -654,48 +909,72 @@ void RENDER_VIEW::keyPressEvent(QKeyEvent *event)
 void RENDER_VIEW::intile_event(int fd)
 {
     assert(fd == m_intile_fd);
-    TILE tile;
-    ssize_t bytes = read(fd, &tile, sizeof(TILE));
+
+    // The renderer only writes whole batches of tiles of at most PIPE_BUF
+    // bytes, so reads always return complete tiles
+    TILE tiles[PIPE_BUF / sizeof(TILE)];
+    ssize_t bytes = read(fd, tiles, sizeof(tiles));
     while (bytes > 0)
     {
-        assert(bytes == sizeof(TILE));
+        assert(bytes % sizeof(TILE) == 0);
 
-        // Copy scanlines into the image
-        for (int y = 0; y < tile.ysize; y++)
+        for (int i = 0; i < (int)(bytes / sizeof(TILE)); i++)
         {
-            memcpy(m_image.get_scan(tile.yoff + y) + tile.xoff,
-                   m_shm_data + m_res.tres*m_res.tres*tile.tid + y*tile.xsize,
-                   tile.xsize*sizeof(uint));
-        }
+            const TILE &tile = tiles[i];
 
-        m_samples_complete += tile.xsize * tile.ysize;
-        m_image_dirty = true;
-        m_tiles_outstanding--;
+            if (tile.xsize == 0)
+            {
+                // The renderer has finished or stopped and is waiting for
+                // updates
+                m_rendering = false;
+                if (!m_updates.empty())
+                {
+                    update_render();
+                    return;
+                }
+                continue;
+            }
 
-        if (m_updates.empty())
-        {
-            // Push the next sample
-            tile.sidx++;
-            if (tile.sidx < m_res.nsamples)
+            if (tile.preview)
             {
-                m_tiles.push(tile);
+                // Pixels are shown from the preview until their tile has
+                // a full resolution sample
+                if (m_clear_on_preview)
+                {
+                    std::fill(m_image.data(), m_image.data() + m_res.pixel_count(), 0);
+                    m_clear_on_preview = false;
+                }
+                m_preview_dirty = true;
+                mark_dirty();
+                continue;
             }
 
-            send_tile(tile.tid);
-            if (!m_tiles_outstanding)
+            // Keep the pixels of full resolution tiles, which may be seeded
+            // by the renderer before the preview
+            m_clear_on_preview = false;
+
+            // Copy scanlines into the image. The float buffer is displayed
+            // directly from shared memory.
+            if (!m_res.float_buffer)
             {
-                finish_tile_rendering();
+                for (int y = 0; y < tile.ysize; y++)
+                {
+                    memcpy(m_image.get_scan(tile.yoff + y) + tile.xoff,
+                           m_shm_data + (tile.yoff + y)*m_res.xres + tile.xoff,
+                           tile.xsize*sizeof(uint));
+                }
             }
-        }
-        else
-        {
-            if (!m_tiles_outstanding)
+
+            // Count the samples skipped by adaptive sampling as complete
+            int samples = tile.last ? m_res.nsamples - tile.sidx : 1;
+            m_samples_complete += tile.xsize * tile.ysize * (size_t)samples;
+            for (int r = 0; r < 3; r++)
             {
-                update_render();
-                return;
+                m_rays_complete[r] += tile.rays[r];
             }
+            mark_dirty(QRect(tile.xoff, tile.yoff, tile.xsize, tile.ysize));
         }
-        bytes = read(fd, &tile, sizeof(TILE));
+        bytes = read(fd, tiles, sizeof(tiles));
     }
 
     if (bytes == 0)
@@ -710,38 +989,28 @@ void RENDER_VIEW::intile_event(int fd)
     }
 }
 
-void RENDER_VIEW::send_tile(int tid)
+void RENDER_VIEW::stop_tile_rendering()
 {
-    if (!m_tiles.empty())
+    // Ask the renderer to stop scheduling tiles. It will reply with an
+    // empty tile once all threads are idle. The cancel flag also abandons
+    // the tiles and geometry build in progress.
+    if (m_shm_data)
     {
-        TILE tile = m_tiles.front();
-        tile.tid = tid;
-        m_tiles.pop();
-        if (write(m_outtile_fd, &tile, sizeof(TILE)) < 0)
-        {
-            perror("write failed");
-        }
-
-        m_tiles_outstanding++;
+        auto cancel = (std::atomic<uint32_t> *)((char *)m_shm_data + m_res.cancel_offset());
+        cancel->store(1);
     }
-}
 
-void RENDER_VIEW::finish_tile_rendering()
-{
-    // Send empty tiles to exit any outstanding rendering threads
-    TILE tile;
-    for (int i = 0; i < m_res.nthreads; i++)
+    REQUEST request;
+    request.type = REQUEST::STOP;
+    if (write(m_outtile_fd, &request, sizeof(REQUEST)) < 0)
     {
-        if (write(m_outtile_fd, &tile, sizeof(TILE)) < 0)
-        {
-            perror("write failed");
-        }
+        perror("write failed");
     }
 }
 
 void RENDER_VIEW::timerEvent(QTimerEvent *)
 {
-    if (!m_updates.empty() && !m_tiles_outstanding)
+    if (!m_updates.empty() && !m_rendering)
     {
         if (m_child > 0)
         {
@@ -759,13 +1028,27 @@ void RENDER_VIEW::timerEvent(QTimerEvent *)
     }
 }
 
+void RENDER_VIEW::set_ui(const nlohmann::json &json_ui)
+{
+    // Only the types that the renderer decodes from binary updates have
+    // ids, so that any other parameter is sent as JSON
+    m_parameter_ids.clear();
+    for (size_t i = 0; i < json_ui.size(); i++)
+    {
+        const auto &type = json_ui[i]["type"];
+        if (type == "int" || type == "float" || type == "bool" || type == "color")
+        {
+            m_parameter_ids[json_ui[i]["name"].get<std::string>()] = i;
+        }
+    }
+}
+
 void RENDER_VIEW::set_parameter(const std::string &name, const nlohmann::json &value)
 {
     m_scene[name] = value;
-    if (m_updates.empty() && m_tiles_outstanding)
+    if (m_updates.empty() && m_rendering)
     {
-        m_tiles = std::queue<TILE>();
-        finish_tile_rendering();
+        stop_tile_rendering();
     }
     m_updates[name] = value;
 }
@@ -786,7 +1069,33 @@ void RENDER_VIEW::open(std::istream &is, const nlohmann::json &defs)
     start_render();
 }
 
-QImage RENDER_VIEW::get_qimage() const
+void RENDER_VIEW::resolve_image()
+{
+    if (!m_res.float_buffer || !m_shm_data)
+    {
+        return;
+    }
+
+    const float *accum = (const float *)m_shm_data;
+    const float *counts = (const float *)((const char *)m_shm_data + m_res.samples_offset());
+    uint32_t *data = m_image.data();
+    for (size_t i = 0; i < m_res.pixel_count(); i++)
+    {
+        float color[3];
+        float count;
+        read_float_pixel(accum, counts, i, color, count);
+        float scale = 1.0F / std::max(count, 1.0F);
+        uint32_t val = 0xFF000000;
+        for (int c = 0; c < 3; c++)
+        {
+            float v = std::min(powf(std::max(color[c] * scale, 0.0F), m_res.igamma), 1.0F);
+            val |= (uint32_t)(v * 255.0F + 0.5F) << (8*c);
+        }
+        data[i] = val;
+    }
+}
+
+QImage RENDER_VIEW::get_qimage()
 {
     const RASTER<uint32_t> *image = nullptr;
     if (m_snapshot_active)
@@ -795,6 +1104,7 @@ QImage RENDER_VIEW::get_qimage() const
     }
     else
     {
+        resolve_image();
         image = &m_image;
     }
 
@@ -10,11 +10,11 @@
 #include <QtGui>
 #include <QGLWidget>
 #include <QtOpenGL>
-#include <queue>
 #include "raster.h"
 #include "../h/tile.h"
 #include <nlohmann/json.hpp>
 #include <iomanip>
+#include <map>
 
 // Render view
 class RENDER_VIEW : public QGLWidget { Q_OBJECT
@@ -27,6 +27,10 @@ public:
 
     void set_parameter(const std::string &name, const nlohmann::json &value);
 
+    // The --dump_ui parameters, whose order assigns the ids of binary
+    // updates
+    void set_ui(const nlohmann::json &json_ui);
+
     void set_scene(const nlohmann::json &scene)
     {
         m_scene = scene;
@@ -41,7 +45,7 @@ public:
     void open(std::istream &is, const nlohmann::json &defs);
 
     // NOTE: The returned QImage references the pointer owned by this class
-    QImage get_qimage() const;
+    QImage get_qimage();
 
 public slots:
     bool start_render();
@@ -51,8 +55,22 @@ public slots:
     void toggle_snapshot();
 
 protected:
-    void send_tile(int tid);
-    void finish_tile_rendering();
+    void stop_tile_rendering();
+
+    // Gamma corrects the shared float buffer into m_image
+    void resolve_image();
+
+    // Record a region of the image to upload, or the whole image
+    void mark_dirty(const QRect &rect);
+    void mark_dirty();
+
+    // Take the dirty regions, merged into one if they cover much of the
+    // image
+    std::vector<QRect> dirty_rects();
+
+    // Update only the given regions of the display textures
+    void upload_image(const RASTER<uint32_t> &image, const std::vector<QRect> &rects);
+    void upload_float_buffer(const std::vector<QRect> &rects);
 
     bool update_render();
     bool handshake_render();
@@ -84,7 +102,30 @@ private:
 
     QGLShaderProgram       *m_program = nullptr;
     GLuint                  m_texture = 0;
-    GLuint                  m_pbuffer = 0;
+    QSize                   m_texture_size;
+
+    // Ring of pixel buffers for uploading the 8-bit image
+    static const int        s_pbuffer_count = 3;
+    GLuint                  m_pbuffers[s_pbuffer_count] = {0, 0, 0};
+    int                     m_pbuffer_index = 0;
+
+    // Regions of the image changed since the last upload
+    std::vector<QRect>      m_dirty_rects;
+
+    // Float accumulation buffer and sample counts, copied consistently from
+    // shared memory when the renderer uses RES::float_buffer
+    GLuint                  m_accum_texture = 0;
+    GLuint                  m_count_texture = 0;
+    QSize                   m_accum_size;
+    QSize                   m_count_size;
+    std::vector<float>      m_accum_staging;
+    std::vector<float>      m_count_staging;
+
+    // Low resolution preview pass, shown for pixels that have no full
+    // resolution sample yet
+    GLuint                  m_preview_texture = 0;
+    bool                    m_preview_dirty = false;
+    bool                    m_clear_on_preview = false;
 
     // Snapshots
     RASTER<uint32_t>        m_snapshot;
@@ -97,6 +138,9 @@ private:
     // Pending updates to the scene
     nlohmann::json          m_updates;
 
+    // Ids of the numeric parameters, indexed by name
+    std::map<std::string, int> m_parameter_ids;
+
     // Render process connection
     // {
     pid_t                m_child = 0;
@@ -109,14 +153,16 @@ private:
     uint                *m_shm_data = nullptr;
     // }
 
-    // Tile queue (from the renderer)
+    // Render progress (tiles are scheduled by the renderer)
     RES                  m_res;
-    std::queue<TILE>     m_tiles;
-    int                  m_tiles_outstanding = 0;
+    bool                 m_rendering = false;
     size_t               m_samples_complete = 0;
+    size_t               m_rays_complete[3] = {0, 0, 0}; // Primary, reflection, shadow
     double               m_start_time = 0;
 
     QPoint m_mousepos;
+    QPoint m_presspos; // Where the left button went down
+    bool   m_panned = false; // The image was dragged since the press
     QPoint m_offset;
     float  m_zoom = 1.0;
 };
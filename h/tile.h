@@ -4,20 +4,63 @@
    Copyright (C) 2021 Andrew Clinton
 */
 
+#ifndef TILE_H
+#define TILE_H
+
 struct RES {
     int xres = 0;
     int yres = 0;
     int tres = 0; // Tile resolution
     int nsamples = 0; // Pixel samples
     int nthreads = 0; // Thread count
+    int float_buffer = 0; // Share the float accumulation buffer
+    float igamma = 1.0F; // Display gamma correction
+    int preview_scale = 0; // Pixel size of the preview pass, 0 if disabled
 
     int tile_count() const
     {
         return ((xres + tres - 1) / tres) * ((yres + tres - 1) / tres);
     }
+    size_t pixel_count() const
+    {
+        return (size_t)xres*yres;
+    }
+
+    // The shared memory holds either the full 8-bit display image or, with
+    // float_buffer, the RGB float accumulation buffer followed by a float
+    // plane of per-pixel sample counts. Either way tile completions can be
+    // reported in batches. The 8-bit preview image follows, with one pixel
+    // per preview_scale square of the image.
+    size_t samples_offset() const
+    {
+        return pixel_count()*3*sizeof(float);
+    }
+    size_t preview_offset() const
+    {
+        if (float_buffer)
+        {
+            return pixel_count()*4*sizeof(float);
+        }
+        return pixel_count()*sizeof(uint32_t);
+    }
+    int preview_xres() const
+    {
+        return preview_scale ? (xres + preview_scale - 1) / preview_scale : 0;
+    }
+    int preview_yres() const
+    {
+        return preview_scale ? (yres + preview_scale - 1) / preview_scale : 0;
+    }
+    // Last is a 32-bit cancel flag in its own cache line, which the GUI
+    // sets to abandon the current render mid-tile
+    size_t cancel_offset() const
+    {
+        size_t end = preview_offset() + (size_t)preview_xres()*preview_yres()*sizeof(uint32_t);
+        return (end + 63) & ~(size_t)63;
+    }
     size_t shm_size() const
     {
-        return nthreads*tres*tres*sizeof(uint32_t);
+        return cancel_offset() + 64;
     }
 };
 
@@ -29,5 +72,36 @@ struct TILE {
     int ysize = 0;
     int sidx = 0; // Sample index
     int tid = 0; // Thread index
+    float error = 0; // Noise estimate after the sample, infinite if unknown
+    int last = 0; // Set when the tile will not be sampled again
+    float time = 0; // Render time of the sample in seconds
+    int rays[3] = {0, 0, 0}; // Primary, reflection and shadow rays traced
+    int preview = 0; // Set for the preview pass, which precedes sample 0
+};
+
+// Requests sent from the GUI to the renderer on the tile pipe
+struct REQUEST {
+    enum TYPE {
+        STOP, // Stop rendering and wait for scene updates
+        FOCUS // Render the tiles nearest image pixel (x, y) first
+    };
+    int type = STOP;
+    int x = 0;
+    int y = 0;
+};
+
+// Numeric parameter updates are written to the renderer's stdin in this
+// binary form rather than as a JSON object. The header is followed by count
+// values. Parameter ids are indices into the --dump_ui parameter array.
+struct PARAM_UPDATE {
+    char tag[4] = {'S', 'L', 'U', 'P'}; // Can't begin a JSON object
+    int count = 0;
+};
+
+struct PARAM_VALUE {
+    int id = 0;
+    int component = 0; // Index of a vector parameter component
+    double value = 0; // Bools are 0 or 1
 };
 
+#endif // TILE_H
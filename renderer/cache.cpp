@@ -0,0 +1,281 @@
+/*
+   Shoreline Renderer
+
+   Copyright (C) 2021 Andrew Clinton
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <map>
+#include "cache.h"
+
+// Increment when the geometry generation changes to invalidate old entries
+static const uint32_t s_cache_version = 4;
+static const uint32_t s_cache_magic = 0x43474c53; // SLGC
+
+// Buffer data is aligned and padded so that Embree may read a full SSE
+// vector past the last element
+static const size_t s_buffer_alignment = 16;
+
+struct CACHE_HEADER
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    key;
+    uint32_t    buffer_count;
+    uint32_t    pad;
+};
+
+struct CACHE_BUFFER_HEADER
+{
+    CACHE_BUFFER    buffer;
+    uint64_t        offset;
+};
+
+static std::string s_directory;
+
+// Mapped entries, with the number of geometries loaded from each. Geometry
+// that is released without release() keeps its entry mapped until
+// release_all(), since Embree may still reference it.
+struct CACHE_ENTRY
+{
+    const char  *data;
+    size_t      size;
+    int         users;
+};
+static std::mutex s_mutex;
+static std::map<uint64_t, CACHE_ENTRY> s_entries;
+static std::map<RTCGeometry, uint64_t> s_users;
+
+// Drop a use of the entry, which the caller holds s_mutex for
+static void release_entry(uint64_t key)
+{
+    auto it = s_entries.find(key);
+    if (it != s_entries.end() && --it->second.users == 0)
+    {
+        munmap((void *)it->second.data, it->second.size);
+        s_entries.erase(it);
+    }
+}
+
+static std::string entry_path(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016lx.geo", (unsigned long)key);
+    return s_directory + name;
+}
+
+static size_t align(size_t offset)
+{
+    return (offset + s_buffer_alignment - 1) & ~(s_buffer_alignment - 1);
+}
+
+void GEOMETRY_CACHE::set_directory(const std::string &dir)
+{
+    s_directory = dir;
+}
+
+uint64_t GEOMETRY_CACHE::combine(uint64_t hash, const std::string &str)
+{
+    // FNV-1a, including the terminator to separate consecutive strings
+    for (size_t i = 0; i <= str.size(); i++)
+    {
+        hash ^= (unsigned char)str.c_str()[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t GEOMETRY_CACHE::key(const std::string &kind,
+                             const nlohmann::json &parameters,
+                             const nlohmann::json &json_ui)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    auto add = [&hash](const std::string &str) { hash = combine(hash, str); };
+
+    add(std::to_string(s_cache_version));
+    add(kind);
+    for (const auto &p : json_ui)
+    {
+        const std::string &name = p["name"].get<std::string>();
+        add(name);
+        add(parameters[name].dump());
+    }
+
+    return hash;
+}
+
+bool GEOMETRY_CACHE::load(uint64_t key, RTCGeometry geom)
+{
+    if (s_directory.empty())
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(s_mutex);
+
+    auto it = s_entries.find(key);
+    if (it == s_entries.end())
+    {
+        int fd = open(entry_path(key).c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        void *data = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CACHE_HEADER))
+        {
+            data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+
+        if (data == MAP_FAILED)
+        {
+            return false;
+        }
+
+        // Validate the entry before using it
+        size_t size = st.st_size;
+        const CACHE_HEADER *header = (const CACHE_HEADER *)data;
+        bool valid = header->magic == s_cache_magic &&
+                     header->version == s_cache_version &&
+                     header->key == key &&
+                     sizeof(CACHE_HEADER) + header->buffer_count*sizeof(CACHE_BUFFER_HEADER) <= size;
+
+        const CACHE_BUFFER_HEADER *buffers = (const CACHE_BUFFER_HEADER *)(header + 1);
+        for (uint32_t i = 0; valid && i < header->buffer_count; i++)
+        {
+            const CACHE_BUFFER &b = buffers[i].buffer;
+            valid = buffers[i].offset % s_buffer_alignment == 0 &&
+                    buffers[i].offset + (uint64_t)b.stride*b.count + s_buffer_alignment <= size;
+        }
+
+        if (!valid)
+        {
+            fprintf(stderr, "Ignoring invalid cache entry %s\n", entry_path(key).c_str());
+            munmap(data, size);
+            return false;
+        }
+
+        it = s_entries.emplace(key, CACHE_ENTRY{(const char *)data, size, 0}).first;
+    }
+
+    // A geometry already recorded here was released without release(),
+    // and its address reused
+    it->second.users++;
+    auto user = s_users.find(geom);
+    if (user != s_users.end())
+    {
+        uint64_t old_key = user->second;
+        user->second = key;
+        release_entry(old_key);
+    }
+    else
+    {
+        s_users.emplace(geom, key);
+    }
+
+    const char *data = it->second.data;
+    const CACHE_HEADER *header = (const CACHE_HEADER *)data;
+    const CACHE_BUFFER_HEADER *buffers = (const CACHE_BUFFER_HEADER *)(header + 1);
+    for (uint32_t i = 0; i < header->buffer_count; i++)
+    {
+        const CACHE_BUFFER &b = buffers[i].buffer;
+        rtcSetSharedGeometryBuffer(geom, b.type, b.slot, b.format,
+                                   data, buffers[i].offset, b.stride, b.count);
+    }
+
+    return true;
+}
+
+void GEOMETRY_CACHE::release(RTCGeometry geom)
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+
+    auto user = s_users.find(geom);
+    if (user != s_users.end())
+    {
+        uint64_t key = user->second;
+        s_users.erase(user);
+        release_entry(key);
+    }
+}
+
+void GEOMETRY_CACHE::release_all()
+{
+    std::lock_guard<std::mutex> lock(s_mutex);
+
+    for (const auto &entry : s_entries)
+    {
+        munmap((void *)entry.second.data, entry.second.size);
+    }
+    s_entries.clear();
+    s_users.clear();
+}
+
+void GEOMETRY_CACHE::store(uint64_t key, RTCGeometry geom,
+                           const std::vector<CACHE_BUFFER> &buffers)
+{
+    if (s_directory.empty())
+    {
+        return;
+    }
+
+    CACHE_HEADER header = {s_cache_magic, s_cache_version, key, (uint32_t)buffers.size(), 0};
+
+    std::vector<CACHE_BUFFER_HEADER> buffer_headers;
+    size_t offset = align(sizeof(CACHE_HEADER) + buffers.size()*sizeof(CACHE_BUFFER_HEADER));
+    for (const auto &b : buffers)
+    {
+        buffer_headers.push_back(CACHE_BUFFER_HEADER{b, offset});
+        offset = align(offset + (size_t)b.stride*b.count + s_buffer_alignment);
+    }
+    size_t size = offset;
+
+    // Write to a uniquely named temporary file and rename it so that
+    // readers never see a partial entry, even with concurrent writers
+    std::string path = entry_path(key);
+    std::string tmp_path = path + ".XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+    if (!fp)
+    {
+        perror(tmp_path.c_str());
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(tmp_path.c_str());
+        }
+        return;
+    }
+
+    // Entries are readable by other users like regular files
+    fchmod(fd, 0644);
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(buffer_headers.data(), sizeof(CACHE_BUFFER_HEADER), buffer_headers.size(), fp) == buffer_headers.size();
+    for (size_t i = 0; ok && i < buffers.size(); i++)
+    {
+        const CACHE_BUFFER &b = buffers[i];
+        const void *data = rtcGetGeometryBufferData(geom, b.type, b.slot);
+        ok = fseek(fp, buffer_headers[i].offset, SEEK_SET) == 0 &&
+             fwrite(data, b.stride, b.count, fp) == b.count;
+    }
+
+    // Extend the file to cover the padding of the last buffer
+    ok = ok && fflush(fp) == 0 && ftruncate(fileno(fp), size) == 0;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        perror(path.c_str());
+        unlink(tmp_path.c_str());
+    }
+}
@@ -0,0 +1,61 @@
+/*
+   Shoreline Renderer
+
+   Copyright (C) 2021 Andrew Clinton
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <embree3/rtcore.h>
+#include <nlohmann/json.hpp>
+
+// Layout of one geometry buffer in a cache entry
+struct CACHE_BUFFER
+{
+    RTCBufferType   type;
+    unsigned int    slot;
+    RTCFormat       format;
+    unsigned int    stride;
+    unsigned int    count;
+};
+
+// Content addressed on-disk cache of generated geometry buffers. Entries are
+// memory mapped and shared with Embree rather than copied, and stay mapped
+// while geometry loaded from them may be in use.
+class GEOMETRY_CACHE
+{
+public:
+    // Caching is disabled until a directory is set
+    static void set_directory(const std::string &dir);
+
+    // Hash the values of the parameters listed in json_ui along with the
+    // kind of geometry they generate
+    static uint64_t key(const std::string &kind,
+                        const nlohmann::json &parameters,
+                        const nlohmann::json &json_ui);
+
+    // Extend a key with another value
+    static uint64_t combine(uint64_t key, const std::string &str);
+
+    // Share the buffers of a cached entry with geom. Returns false if there
+    // is no valid entry for key.
+    static bool load(uint64_t key, RTCGeometry geom);
+
+    // Called before geom is released, unmapping its entry once no other
+    // loaded geometry uses it. Ignores geometry not loaded from the cache.
+    static void release(RTCGeometry geom);
+
+    // Unmap all entries, once all geometry loaded from them is released
+    static void release_all();
+
+    // Save the given buffers of geom, which must be filled but need not yet
+    // be committed
+    static void store(uint64_t key, RTCGeometry geom,
+                      const std::vector<CACHE_BUFFER> &buffers);
+};
+
+#endif // CACHE_H
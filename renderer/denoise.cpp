@@ -0,0 +1,68 @@
+/*
+   Shoreline Renderer
+
+   Copyright (C) 2021 Andrew Clinton
+*/
+
+#include <stdio.h>
+#include "denoise.h"
+
+#ifdef HAVE_OIDN
+#include <OpenImageDenoise/oidn.hpp>
+
+bool denoise_image(int xres, int yres,
+                   const Imath::C3f *color,
+                   const Imath::C3f *albedo,
+                   const Imath::V3f *normal,
+                   Imath::C3f *output)
+{
+    // The device is reused across frames, since creating it initializes
+    // its own thread pool
+    static oidn::DeviceRef device;
+    if (!device)
+    {
+        device = oidn::newDevice();
+        device.commit();
+    }
+
+    oidn::FilterRef filter = device.newFilter("RT");
+    filter.setImage("color", (void *)color, oidn::Format::Float3, xres, yres);
+    if (albedo)
+    {
+        filter.setImage("albedo", (void *)albedo, oidn::Format::Float3, xres, yres);
+
+        // Normals are only used along with albedo
+        if (normal)
+        {
+            filter.setImage("normal", (void *)normal, oidn::Format::Float3, xres, yres);
+        }
+    }
+    filter.setImage("output", output, oidn::Format::Float3, xres, yres);
+    filter.set("hdr", true);
+    filter.commit();
+    filter.execute();
+
+    const char *message;
+    if (device.getError(message) != oidn::Error::None)
+    {
+        fprintf(stderr, "Denoise error: %s\n", message);
+        return false;
+    }
+    return true;
+}
+
+#else
+
+bool denoise_image(int, int, const Imath::C3f *, const Imath::C3f *,
+                   const Imath::V3f *, Imath::C3f *)
+{
+    static bool warned = false;
+    if (!warned)
+    {
+        fprintf(stderr, "Denoising requires building with Open Image Denoise (OIDN_DIR)\n");
+        warned = true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,22 @@
+/*
+   Shoreline Renderer
+
+   Copyright (C) 2021 Andrew Clinton
+*/
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "ImathVec.h"
+#include "ImathColor.h"
+
+// Denoise a normalized HDR image guided by first hit albedo and normals,
+// which may be null. Returns false if denoising is unavailable or fails,
+// leaving output unchanged.
+bool denoise_image(int xres, int yres,
+                   const Imath::C3f *color,
+                   const Imath::C3f *albedo,
+                   const Imath::V3f *normal,
+                   Imath::C3f *output);
+
+#endif // DENOISE_H
@@ -6,12 +6,14 @@
 
 #include <boost/program_options.hpp>
 #include <iostream>
+#include <fstream>
 #include <fcntl.h>
 #include <nlohmann/json.hpp>
 #include "scene.h"
 #include "terrain.h"
 #include "tree.h"
 #include "shading.h"
+#include "cache.h"
 #include "common.h"
 
 // Embree suggested optimization
@@ -20,12 +22,196 @@
 
 namespace po = boost::program_options;
 
+static nlohmann::json publish_ui()
+{
+    nlohmann::json json_ui = {
+        {
+            {"name", "res"},
+            {"type", "int"},
+            {"vector_size", 2},
+            {"default", {800,600}},
+            {"min", 1},
+            {"max", 10000}
+        },
+        {
+            {"name", "tres"},
+            {"type", "int"},
+            {"default", 64},
+            {"scale", "log"},
+            {"min", 1},
+            {"max", 1024}
+        },
+        {
+            {"name", "nthreads"},
+            {"type", "int"},
+            {"default", 4},
+            {"scale", "log"},
+            {"min", 1},
+            {"max", 128}
+        },
+        {
+            {"name", "samples"},
+            {"type", "int"},
+            {"default", 16},
+            {"scale", "log"},
+            {"min", 1},
+            {"max", 1024}
+        },
+        {
+            {"name", "camera_pos"},
+            {"type", "float"},
+            {"vector_size", 3},
+            {"default", {0, -2.5, 1}},
+            {"min", -1000},
+            {"max",  1000}
+        },
+        {
+            {"name", "camera_pitch"},
+            {"type", "float"},
+            {"default", 0},
+            {"min", -90.0},
+            {"max", 90.0}
+        },
+        {
+            {"name", "camera_yaw"},
+            {"type", "float"},
+            {"default", 0},
+            {"min", -180.0},
+            {"max", 180.0}
+        },
+        {
+            {"name", "camera_roll"},
+            {"type", "float"},
+            {"default", 0},
+            {"min", -180.0},
+            {"max", 180.0}
+        },
+        {
+            {"name", "field_of_view"},
+            {"type", "float"},
+            {"default", 60.0},
+            {"min", 0.001},
+            {"max", 90.0}
+        },
+        {
+            {"name", "sampling_seed"},
+            {"type", "int"},
+            {"default", 0},
+            {"min", 0},
+            {"max", 10}
+        },
+        {
+            {"name", "sampler"},
+            {"type", "string"},
+            {"default", "pairs"},
+            {"values", {"pairs", "sobol"}}
+        },
+        {
+            {"name", "gamma"},
+            {"type", "float"},
+            {"default", 2.2},
+            {"min", 1.0},
+            {"max", 2.2}
+        },
+        {
+            {"name", "preview_scale"},
+            {"type", "int"},
+            {"default", 8},
+            {"min", 0},
+            {"max", 32}
+        },
+        {
+            {"name", "float_buffer"},
+            {"type", "bool"},
+            {"default", false}
+        },
+        {
+            {"name", "shading"},
+            {"type", "string"},
+            {"default", "physical"},
+            {"values", {"physical", "geomID", "primID", "time", "rays"}}
+        },
+        {
+            {"name", "reflect_limit"},
+            {"type", "int"},
+            {"default", 2},
+            {"min", 1},
+            {"max", 10}
+        },
+        {
+            {"name", "render_profile"},
+            {"type", "string"},
+            {"default", "interactive"},
+            {"values", {"interactive", "final"}}
+        },
+        {
+            {"name", "memory_budget"},
+            {"type", "float"},
+            {"default", 0.0},
+            {"min", 0.0},
+            {"max", 100000.0}
+        },
+        {
+            {"name", "reprojection"},
+            {"type", "bool"},
+            {"default", false}
+        },
+        {
+            {"name", "denoise"},
+            {"type", "bool"},
+            {"default", false}
+        },
+        {
+            {"name", "ray_packets"},
+            {"type", "bool"},
+            {"default", false}
+        },
+        {
+            {"name", "ray_sorting"},
+            {"type", "bool"},
+            {"default", false}
+        },
+        {
+            {"name", "adaptive_threshold"},
+            {"type", "float"},
+            {"default", 0.0},
+            {"min", 0.0},
+            {"max", 0.1}
+        },
+        {
+            {"name", "adaptive_min_samples"},
+            {"type", "int"},
+            {"default", 8},
+            {"min", 2},
+            {"max", 1024},
+            {"scale", "log"}
+        }
+    };
+    SUN_SKY_LIGHT::publish_ui(json_ui);
+    BRDF::publish_ui(json_ui);
+    TERRAIN::publish_ui(json_ui);
+    TREE::publish_ui(json_ui);
+    FOREST::publish_ui(json_ui);
+    return json_ui;
+}
+
 int main(int argc, char *argv[])
 {
     po::options_description desc("Options");
     desc.add_options()
         ("help", "Produce help message")
         ("dump_ui", "Print UI parameter .json")
+        ("batch", po::value<std::string>(), "Render the scene .json without the GUI")
+        ("output,o", po::value<std::string>(), "Output image for batch rendering (.exr)")
+        ("sequence", po::value<std::string>(), "Render the keyframes of a sequence .json with --batch, numbering the output images")
+        ("nthreads", po::value<int>(), "Override the scene thread count for batch rendering")
+        ("cache_dir", po::value<std::string>(), "Directory for caching generated geometry")
+        ("stats", po::value<std::string>(), "Append batch render statistics to a .jsonl file")
+        ("profile", po::value<std::string>(), "Override the scene render profile (interactive or final)")
+        ("listen", po::value<int>(), "Render the --batch scene on workers connecting to this port")
+        ("chunk", po::value<int>()->default_value(4), "Samples of a tile handed to a worker at a time with --listen")
+        ("worker", po::value<std::string>(), "Render tiles for the coordinator at host:port")
+        ("memory_budget", po::value<float>(), "Override the scene Embree memory budget in Mb, reducing detail to fit")
     ;
 
     po::variables_map vm;
@@ -49,109 +235,7 @@ int main(int argc, char *argv[])
 
     if (vm.count("dump_ui"))
     {
-        nlohmann::json json_ui = {
-            {
-                {"name", "res"},
-                {"type", "int"},
-                {"vector_size", 2},
-                {"default", {800,600}},
-                {"min", 1},
-                {"max", 10000}
-            },
-            {
-                {"name", "tres"},
-                {"type", "int"},
-                {"default", 64},
-                {"scale", "log"},
-                {"min", 1},
-                {"max", 1024}
-            },
-            {
-                {"name", "nthreads"},
-                {"type", "int"},
-                {"default", 4},
-                {"scale", "log"},
-                {"min", 1},
-                {"max", 128}
-            },
-            {
-                {"name", "samples"},
-                {"type", "int"},
-                {"default", 16},
-                {"scale", "log"},
-                {"min", 1},
-                {"max", 1024}
-            },
-            {
-                {"name", "camera_pos"},
-                {"type", "float"},
-                {"vector_size", 3},
-                {"default", {0, -2.5, 1}},
-                {"min", -1000},
-                {"max",  1000}
-            },
-            {
-                {"name", "camera_pitch"},
-                {"type", "float"},
-                {"default", 0},
-                {"min", -90.0},
-                {"max", 90.0}
-            },
-            {
-                {"name", "camera_yaw"},
-                {"type", "float"},
-                {"default", 0},
-                {"min", -180.0},
-                {"max", 180.0}
-            },
-            {
-                {"name", "camera_roll"},
-                {"type", "float"},
-                {"default", 0},
-                {"min", -180.0},
-                {"max", 180.0}
-            },
-            {
-                {"name", "field_of_view"},
-                {"type", "float"},
-                {"default", 60.0},
-                {"min", 0.001},
-                {"max", 90.0}
-            },
-            {
-                {"name", "sampling_seed"},
-                {"type", "int"},
-                {"default", 0},
-                {"min", 0},
-                {"max", 10}
-            },
-            {
-                {"name", "gamma"},
-                {"type", "float"},
-                {"default", 2.2},
-                {"min", 1.0},
-                {"max", 2.2}
-            },
-            {
-                {"name", "shading"},
-                {"type", "string"},
-                {"default", "physical"},
-                {"values", {"physical", "geomID", "primID"}}
-            },
-            {
-                {"name", "reflect_limit"},
-                {"type", "int"},
-                {"default", 2},
-                {"min", 1},
-                {"max", 10}
-            }
-        };
-        SUN_SKY_LIGHT::publish_ui(json_ui);
-        BRDF::publish_ui(json_ui);
-        TERRAIN::publish_ui(json_ui);
-        TREE::publish_ui(json_ui);
-        FOREST::publish_ui(json_ui);
-        std::cout << json_ui << std::endl;
+        std::cout << publish_ui() << std::endl;
         return 0;
     }
 
@@ -159,7 +243,116 @@ int main(int argc, char *argv[])
     _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
     _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
 
+    if (vm.count("cache_dir"))
+    {
+        GEOMETRY_CACHE::set_directory(vm["cache_dir"].as<std::string>());
+    }
+
     SCENE scene;
+    scene.set_parameters(publish_ui());
+
+    if (vm.count("worker"))
+    {
+        int nthreads = vm.count("nthreads") ? vm["nthreads"].as<int>() : 0;
+        float memory_budget = vm.count("memory_budget") ? vm["memory_budget"].as<float>() : 0.0F;
+        return scene.render_worker(vm["worker"].as<std::string>(), nthreads, memory_budget);
+    }
+
+    if (vm.count("batch"))
+    {
+        if (!vm.count("output"))
+        {
+            std::cerr << "Error: --batch requires an --output image\n";
+            return 1;
+        }
+
+        std::ifstream is(vm["batch"].as<std::string>());
+        if (!is)
+        {
+            std::cerr << "Error: could not open " << vm["batch"].as<std::string>() << "\n";
+            return 1;
+        }
+
+        nlohmann::json json_scene;
+        is >> json_scene;
+
+        // Fill in any parameters missing from the scene with the UI
+        // defaults, as the GUI does when opening a file
+        for (const auto &json_p : publish_ui())
+        {
+            std::string name = json_p["name"];
+            if (json_scene.find(name) == json_scene.end())
+            {
+                json_scene[name] = json_p["default"];
+            }
+        }
+        if (vm.count("nthreads"))
+        {
+            json_scene["nthreads"] = vm["nthreads"].as<int>();
+        }
+        if (vm.count("profile"))
+        {
+            json_scene["render_profile"] = vm["profile"].as<std::string>();
+        }
+        if (vm.count("memory_budget"))
+        {
+            json_scene["memory_budget"] = vm["memory_budget"].as<float>();
+        }
+
+        scene.load(json_scene);
+
+        if (vm.count("listen"))
+        {
+            return scene.render_coordinator(vm["output"].as<std::string>(),
+                                            vm["listen"].as<int>(), vm["chunk"].as<int>());
+        }
+
+        if (vm.count("sequence"))
+        {
+            std::ifstream is(vm["sequence"].as<std::string>());
+            nlohmann::json sequence;
+            if (!(is >> sequence) || !sequence.contains("keys"))
+            {
+                std::cerr << "Error: could not read keys from " << vm["sequence"].as<std::string>() << "\n";
+                return 1;
+            }
+
+            std::ofstream os;
+            if (vm.count("stats"))
+            {
+                os.open(vm["stats"].as<std::string>(), std::ios::app);
+            }
+            return scene.render_sequence(vm["output"].as<std::string>(), sequence,
+                                         [&](int, const nlohmann::json &frame_stats)
+            {
+                if (os.is_open())
+                {
+                    nlohmann::json stats = frame_stats;
+                    stats["scene"] = vm["batch"].as<std::string>();
+                    os << stats << std::endl;
+                }
+            });
+        }
+
+        if (!vm.count("stats"))
+        {
+            return scene.render_batch(vm["output"].as<std::string>());
+        }
+
+        nlohmann::json stats;
+        stats["scene"] = vm["batch"].as<std::string>();
+        int result = scene.render_batch(vm["output"].as<std::string>(), &stats);
+
+        std::ofstream os(vm["stats"].as<std::string>(), std::ios::app);
+        os << stats << std::endl;
+        if (!os)
+        {
+            std::cerr << "Error: could not write " << vm["stats"].as<std::string>() << "\n";
+            return 1;
+        }
+        return result;
+    }
+
     scene.load(std::cin);
 
     // Main event loop
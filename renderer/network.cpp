@@ -0,0 +1,628 @@
+/*
+   Shoreline Renderer
+
+   Copyright (C) 2021 Andrew Clinton
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <deque>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include "network.h"
+
+// Interval between keepalives from a worker that is loading or rendering
+static const int s_keepalive_seconds = 5;
+
+// Longest time to wait for a peer to accept more of a message
+static const int s_send_timeout_ms = 10000;
+
+static bool send_all(int fd, const void *data, size_t size)
+{
+    // The coordinator's sockets are non-blocking, so wait for a full send
+    // buffer to drain rather than fail
+    const char *ptr = (const char *)data;
+    while (size > 0)
+    {
+        ssize_t bytes = send(fd, ptr, size, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            pollfd pfd = {fd, POLLOUT, 0};
+            int ready = poll(&pfd, 1, s_send_timeout_ms);
+            if (ready == 0 || (ready < 0 && errno != EINTR))
+            {
+                return false;
+            }
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        ptr += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *data, size_t size)
+{
+    char *ptr = (char *)data;
+    while (size > 0)
+    {
+        ssize_t bytes = recv(fd, ptr, size, MSG_WAITALL);
+        if (bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        ptr += bytes;
+        size -= bytes;
+    }
+    return true;
+}
+
+// Send a message with a payload gathered from up to two buffers
+static bool send_message(int fd, NET_HEADER::TYPE type,
+                         const void *data = nullptr, size_t size = 0,
+                         const void *data2 = nullptr, size_t size2 = 0)
+{
+    NET_HEADER header;
+    header.type = type;
+    header.size = size + size2;
+    return send_all(fd, &header, sizeof(header)) &&
+           send_all(fd, data, size) &&
+           send_all(fd, data2, size2);
+}
+
+static void set_nodelay(int fd)
+{
+    // Work requests are small and latency bound. Keepalives find peers
+    // whose host has gone away without closing the connection.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+}
+
+bool coordinate_render(int port, const nlohmann::json &scene, const RES &res,
+                       int chunk_samples,
+                       const std::function<void(const NET_WORK &, const Imath::C3f *)> &accumulate,
+                       int worker_timeout)
+{
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
+    {
+        perror("socket");
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0)
+    {
+        perror("bind");
+        close(listen_fd);
+        return false;
+    }
+
+    // Each tile has at most one range of samples out at a time, handed out
+    // in sample-major order. Idle workers pull the next free tile, so faster
+    // nodes take a larger share of the frame.
+    std::vector<NET_WORK> tiles;
+    for (int yoff = 0; yoff < res.yres; yoff += res.tres)
+    {
+        for (int xoff = 0; xoff < res.xres; xoff += res.tres)
+        {
+            NET_WORK work;
+            work.tile.xoff = xoff;
+            work.tile.yoff = yoff;
+            work.tile.xsize = std::min(res.xres - xoff, res.tres);
+            work.tile.ysize = std::min(res.yres - yoff, res.tres);
+            work.index = tiles.size();
+            tiles.push_back(work);
+        }
+    }
+    std::vector<int> next_sample(tiles.size(), 0);
+    std::deque<int> ready;
+    for (int i = 0; i < (int)tiles.size(); i++)
+    {
+        ready.push_back(i);
+    }
+
+    size_t samples_remaining = tiles.size() * (size_t)res.nsamples;
+    const size_t total_samples = samples_remaining;
+    chunk_samples = std::max(chunk_samples, 1);
+
+    const std::string scene_text = scene.dump();
+
+    // Workers are read without blocking, buffering partial messages, so
+    // that a slow or stalled worker can't hold up the others
+    typedef std::chrono::steady_clock CLOCK;
+    struct CONNECTION
+    {
+        int fd;
+        std::string name;
+        std::vector<int> tiles; // Tiles with a range out on this worker
+        std::vector<char> input; // Received bytes of incomplete messages
+        CLOCK::time_point deadline;
+    };
+    std::vector<CONNECTION> workers;
+    const auto timeout = std::chrono::seconds(std::max(worker_timeout, 1));
+    const size_t max_result = sizeof(NET_WORK) + (size_t)res.tres*res.tres*sizeof(Imath::C3f);
+
+    auto drop_worker = [&](size_t w)
+    {
+        // Hand the unfinished ranges out again, ahead of the other tiles
+        for (int t : workers[w].tiles)
+        {
+            next_sample[t] = tiles[t].tile.sidx;
+            ready.push_front(t);
+        }
+        printf("Worker %s left, returning %d tiles\n", workers[w].name.c_str(), (int)workers[w].tiles.size());
+        close(workers[w].fd);
+        workers.erase(workers.begin() + w);
+    };
+
+    // Handle one complete message from a worker, returning false on a
+    // protocol error
+    std::vector<Imath::C3f> colors;
+    auto handle_message = [&](CONNECTION &worker, const NET_HEADER &header, const char *payload)
+    {
+        if (header.type == NET_HEADER::KEEPALIVE)
+        {
+            return true;
+        }
+        if (header.type == NET_HEADER::REQUEST)
+        {
+            if (ready.empty())
+            {
+                return send_message(worker.fd, NET_HEADER::WAIT);
+            }
+
+            int t = ready.front();
+            ready.pop_front();
+
+            NET_WORK &work = tiles[t];
+            work.tile.sidx = next_sample[t];
+            work.count = std::min(chunk_samples, res.nsamples - next_sample[t]);
+            next_sample[t] += work.count;
+            worker.tiles.push_back(t);
+
+            return send_message(worker.fd, NET_HEADER::WORK, &work, sizeof(work));
+        }
+        if (header.type != NET_HEADER::RESULT || header.size < sizeof(NET_WORK))
+        {
+            return false;
+        }
+
+        NET_WORK result;
+        memcpy(&result, payload, sizeof(result));
+
+        // Only the index is taken from the worker. The tile and the range
+        // of samples are the ones handed out, since a tile has one range
+        // out at a time.
+        auto it = std::find(worker.tiles.begin(), worker.tiles.end(), result.index);
+        if (it == worker.tiles.end())
+        {
+            return false;
+        }
+        const NET_WORK work = tiles[result.index];
+        size_t pixels = (size_t)work.tile.xsize*work.tile.ysize;
+        if (result.tile.sidx != work.tile.sidx ||
+            header.size != sizeof(NET_WORK) + pixels*sizeof(Imath::C3f))
+        {
+            return false;
+        }
+
+        // The payload has no alignment, so copy the colors out
+        colors.resize(pixels);
+        memcpy(colors.data(), payload + sizeof(NET_WORK), pixels*sizeof(Imath::C3f));
+        accumulate(work, colors.data());
+        samples_remaining -= work.count;
+
+        worker.tiles.erase(it);
+        if (next_sample[work.index] < res.nsamples)
+        {
+            ready.push_back(work.index);
+        }
+        return true;
+    };
+
+    // Read what has arrived from a worker and handle its complete messages
+    auto receive = [&](CONNECTION &worker, CLOCK::time_point now)
+    {
+        const size_t chunk = 1 << 16;
+        size_t size = worker.input.size();
+        worker.input.resize(size + chunk);
+        ssize_t bytes = recv(worker.fd, worker.input.data() + size, chunk, MSG_DONTWAIT);
+        worker.input.resize(size + std::max(bytes, (ssize_t)0));
+        if (bytes < 0)
+        {
+            return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (bytes == 0)
+        {
+            return false;
+        }
+        worker.deadline = now + timeout;
+
+        size_t offset = 0;
+        while (worker.input.size() - offset >= sizeof(NET_HEADER))
+        {
+            NET_HEADER header;
+            memcpy(&header, worker.input.data() + offset, sizeof(header));
+            if (header.size > max_result)
+            {
+                return false;
+            }
+            if (worker.input.size() - offset < sizeof(header) + header.size)
+            {
+                break;
+            }
+            if (!handle_message(worker, header, worker.input.data() + offset + sizeof(header)))
+            {
+                return false;
+            }
+            offset += sizeof(header) + header.size;
+        }
+        worker.input.erase(worker.input.begin(), worker.input.begin() + offset);
+        return true;
+    };
+
+    printf("Waiting for workers on port %d\n", port);
+    auto last_report = CLOCK::now();
+    while (samples_remaining > 0)
+    {
+        std::vector<pollfd> fds(1 + workers.size());
+        fds[0] = {listen_fd, POLLIN, 0};
+        for (size_t w = 0; w < workers.size(); w++)
+        {
+            fds[w+1] = {workers[w].fd, POLLIN, 0};
+        }
+
+        if (poll(fds.data(), fds.size(), 1000) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        auto now = CLOCK::now();
+        if (now - last_report >= std::chrono::seconds(5))
+        {
+            printf("Rendered %zu of %zu tile samples on %d workers\n",
+                    total_samples - samples_remaining, total_samples, (int)workers.size());
+            last_report = now;
+        }
+
+        // Service the workers in reverse so that dropping one keeps the
+        // remaining indices valid
+        for (size_t w = workers.size(); w-- > 0;)
+        {
+            CONNECTION &worker = workers[w];
+            bool ok = true;
+            if (fds[w+1].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                ok = receive(worker, now);
+            }
+            if (ok && now > worker.deadline)
+            {
+                printf("Worker %s timed out\n", worker.name.c_str());
+                ok = false;
+            }
+
+            if (!ok)
+            {
+                drop_worker(w);
+            }
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            sockaddr_storage client_addr;
+            socklen_t len = sizeof(client_addr);
+            int fd = accept(listen_fd, (sockaddr *)&client_addr, &len);
+            if (fd >= 0)
+            {
+                char host[NI_MAXHOST] = "?";
+                getnameinfo((sockaddr *)&client_addr, len, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+                set_nodelay(fd);
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+                // New workers build the scene before asking for work
+                if (send_message(fd, NET_HEADER::SCENE, scene_text.data(), scene_text.size()))
+                {
+                    workers.push_back(CONNECTION{fd, host, {}, {}, CLOCK::now() + timeout});
+                    printf("Worker %s joined\n", host);
+                }
+                else
+                {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    for (auto &worker : workers)
+    {
+        send_message(worker.fd, NET_HEADER::DONE);
+        close(worker.fd);
+    }
+    close(listen_fd);
+
+    return samples_remaining == 0;
+}
+
+bool run_worker(const std::string &address,
+                const std::function<RES(const nlohmann::json &)> &load,
+                const std::function<void(const NET_WORK &, int, std::vector<Imath::C3f> &)> &render)
+{
+    size_t colon = address.rfind(':');
+    if (colon == std::string::npos)
+    {
+        fprintf(stderr, "Error: expected host:port, not %s\n", address.c_str());
+        return false;
+    }
+    std::string host = address.substr(0, colon);
+    std::string port = address.substr(colon+1);
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *info = nullptr;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &info);
+    if (err)
+    {
+        fprintf(stderr, "Error: %s: %s\n", address.c_str(), gai_strerror(err));
+        return false;
+    }
+
+    int fd = -1;
+    for (addrinfo *ai = info; ai && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(info);
+    if (fd < 0)
+    {
+        perror(address.c_str());
+        return false;
+    }
+    set_nodelay(fd);
+
+    NET_HEADER header;
+    std::string scene_text;
+    if (!recv_all(fd, &header, sizeof(header)) || header.type != NET_HEADER::SCENE)
+    {
+        fprintf(stderr, "Error: no scene from %s\n", address.c_str());
+        close(fd);
+        return false;
+    }
+    scene_text.resize(header.size);
+    if (!recv_all(fd, &scene_text[0], header.size))
+    {
+        close(fd);
+        return false;
+    }
+
+    // A connection thread reads the coordinator's replies into a queue of
+    // work, which the render threads keep topped up with requests as they
+    // take from it. This keeps a few requests in flight so that the render
+    // threads don't wait on the network between tiles. Writes to the
+    // socket are serialized by send_mutex, and requests are sent under
+    // mutex so that they agree with the count in flight.
+    std::mutex mutex;
+    std::mutex send_mutex;
+    std::condition_variable work_ready;
+    std::deque<NET_WORK> queue;
+    int requested = 0; // Requests without a reply
+    int prefetch = 0; // Work to have queued or requested, 0 while loading
+    bool waiting = false; // The coordinator had no free work
+    bool done = false;
+    bool error = false;
+
+    auto send_locked = [&](NET_HEADER::TYPE type, const void *data = nullptr, size_t size = 0,
+                           const void *data2 = nullptr, size_t size2 = 0)
+    {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        return send_message(fd, type, data, size, data2, size2);
+    };
+
+    // Called with mutex held. Only one request is kept out while the
+    // coordinator has no free work.
+    auto request_work = [&]()
+    {
+        int target = waiting ? std::min(prefetch, 1) : prefetch;
+        while (!done && (int)queue.size() + requested < target)
+        {
+            if (!send_locked(NET_HEADER::REQUEST))
+            {
+                done = true;
+                work_ready.notify_all();
+                break;
+            }
+            requested++;
+        }
+    };
+
+    // The connection thread also lets the coordinator know the worker is
+    // alive while it loads the scene or renders long ranges of samples
+    std::thread connection([&]
+    {
+        typedef std::chrono::steady_clock CLOCK;
+        const auto wait_delay = std::chrono::milliseconds(20);
+        auto next_keepalive = CLOCK::now();
+        auto next_request = CLOCK::now();
+        while (true)
+        {
+            auto now = CLOCK::now();
+            if (now >= next_keepalive)
+            {
+                send_locked(NET_HEADER::KEEPALIVE);
+                next_keepalive = now + std::chrono::seconds(s_keepalive_seconds);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (done)
+                {
+                    break;
+                }
+                if (waiting && now >= next_request)
+                {
+                    request_work();
+                }
+            }
+
+            auto until = std::min(next_keepalive, waiting ? next_request : next_keepalive);
+            int timeout = std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count();
+            pollfd pfd = {fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, std::max(timeout, 1));
+            if (ready < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            NET_HEADER reply;
+            NET_WORK work;
+            bool ok = ready >= 0;
+            if (ok && ready > 0)
+            {
+                ok = recv_all(fd, &reply, sizeof(reply)) &&
+                     (reply.type != NET_HEADER::WORK || recv_all(fd, &work, sizeof(work)));
+            }
+            if (ok && ready == 0)
+            {
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!ok || reply.type == NET_HEADER::DONE)
+            {
+                // The coordinator may close the connection once the frame
+                // is complete
+                done = true;
+                work_ready.notify_all();
+                break;
+            }
+
+            requested--;
+            waiting = reply.type == NET_HEADER::WAIT;
+            if (waiting)
+            {
+                next_request = CLOCK::now() + wait_delay;
+                continue;
+            }
+            if (reply.type == NET_HEADER::WORK)
+            {
+                queue.push_back(work);
+                work_ready.notify_one();
+            }
+            request_work();
+        }
+    });
+
+    // Wake the connection thread from poll and wait for it to finish
+    auto stop_connection = [&]()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        shutdown(fd, SHUT_RDWR);
+        connection.join();
+    };
+
+    RES res = load(nlohmann::json::parse(scene_text));
+    if (res.nthreads <= 0)
+    {
+        fprintf(stderr, "Error: could not load the scene from %s\n", address.c_str());
+        stop_connection();
+        close(fd);
+        return false;
+    }
+
+    // Queue a tile for each thread, along with one in flight for each
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        prefetch = 2*res.nthreads;
+        request_work();
+    }
+
+    tbb::task_arena arena(res.nthreads);
+    arena.execute([&]
+    {
+        tbb::parallel_for(tbb::blocked_range<int>(0,res.nthreads,1),
+                          [&](tbb::blocked_range<int>)
+        {
+            int tid = tbb::this_task_arena::current_thread_index();
+            std::vector<Imath::C3f> colors;
+            while (true)
+            {
+                NET_WORK work;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    work_ready.wait(lock, [&] { return !queue.empty() || done; });
+                    if (queue.empty())
+                    {
+                        break;
+                    }
+                    work = queue.front();
+                    queue.pop_front();
+                    request_work();
+                }
+
+                render(work, tid, colors);
+
+                if (!send_locked(NET_HEADER::RESULT, &work, sizeof(work),
+                                 colors.data(), colors.size()*sizeof(Imath::C3f)))
+                {
+                    perror("send");
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = true;
+                    done = true;
+                    work_ready.notify_all();
+                }
+            }
+        }, tbb::simple_partitioner());
+    });
+    stop_connection();
+
+    close(fd);
+    return !error;
+}
@@ -0,0 +1,64 @@
+/*
+   Shoreline Renderer
+
+   Copyright (C) 2021 Andrew Clinton
+*/
+
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <nlohmann/json.hpp>
+#include "ImathColor.h"
+#include "tile.h"
+
+// Messages between a render coordinator and its workers over TCP. Each is a
+// NET_HEADER followed by size bytes of payload. As with the pipe protocol,
+// all nodes must share the same byte order and struct layout.
+struct NET_HEADER
+{
+    enum TYPE {
+        SCENE,  // Coordinator to worker: the scene .json text
+        REQUEST,// Worker to coordinator: ask for a NET_WORK
+        WORK,   // Coordinator to worker: a NET_WORK to render
+        WAIT,   // Coordinator to worker: no work is free yet, ask again
+        RESULT, // Worker to coordinator: a NET_WORK followed by the summed
+                // radiance of its samples for each pixel of the tile
+        DONE,   // Coordinator to worker: the frame is complete
+        KEEPALIVE // Worker to coordinator: still loading or rendering
+    };
+    uint32_t type = DONE;
+    uint32_t size = 0;
+};
+
+// A range of samples of one tile, starting at tile.sidx
+struct NET_WORK
+{
+    TILE tile;
+    int32_t count = 0;
+    int32_t index = 0; // Tile index assigned by the coordinator
+};
+
+// Serve the samples of every tile of res to workers connecting on port,
+// calling accumulate with the result of each range of samples. Workers may
+// join or leave at any time, and the work of a worker that leaves, or that
+// sends nothing for worker_timeout seconds, is handed out again. Returns
+// false if the port cannot be opened.
+bool coordinate_render(int port, const nlohmann::json &scene, const RES &res,
+                       int chunk_samples,
+                       const std::function<void(const NET_WORK &, const Imath::C3f *)> &accumulate,
+                       int worker_timeout = 60);
+
+// Connect to a coordinator at host:port, load its scene and render work
+// until the frame is complete. render is called concurrently from
+// res.nthreads threads with the thread index. load returns a RES with no
+// threads if the scene cannot be loaded. Returns false on connection or
+// load errors.
+bool run_worker(const std::string &address,
+                const std::function<RES(const nlohmann::json &)> &load,
+                const std::function<void(const NET_WORK &, int, std::vector<Imath::C3f> &)> &render);
+
+#endif // NETWORK_H
@@ -0,0 +1,85 @@
+/*
+   Shoreline Renderer
+
+   Copyright (C) 2021 Andrew Clinton
+*/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <string>
+#include <atomic>
+#include <embree3/rtcore.h>
+#include <nlohmann/json.hpp>
+
+// Embree build settings for a render profile. Interactive builds are fast,
+// and scenes that are edited are dynamic so that geometry carried over
+// between edits keeps its BVH. Final builds spend longer for the fastest
+// traversal.
+struct BUILD_PROFILE
+{
+    BUILD_PROFILE(const nlohmann::json &parameters)
+    {
+        if (parameters["render_profile"] == "final")
+        {
+            quality = RTC_BUILD_QUALITY_HIGH;
+            flags = RTC_SCENE_FLAG_COMPACT;
+            dynamic = false;
+        }
+    }
+
+    // Create a scene with the profile settings. Scenes that are built once
+    // and never edited need not be dynamic.
+    RTCScene new_scene(RTCDevice device, bool edited = false) const
+    {
+        RTCScene scene = rtcNewScene(device);
+        rtcSetSceneBuildQuality(scene, quality);
+        rtcSetSceneFlags(scene, (RTCSceneFlags)(flags | (edited && dynamic ? RTC_SCENE_FLAG_DYNAMIC : 0)));
+        if (s_cancel)
+        {
+            rtcSetSceneProgressMonitorFunction(scene, [](void *, double) { return !cancelled(); }, nullptr);
+        }
+        return scene;
+    }
+
+    // Rough size of the BVH built over the given number of primitives,
+    // including the primitive data Embree copies into its leaves
+    size_t bvh_estimate(size_t primitives) const
+    {
+        return primitives * ((flags & RTC_SCENE_FLAG_COMPACT) ? 64 : 96);
+    }
+
+    // Builds poll the flag, which is nonzero once the result is no longer
+    // wanted. Embree builds stop early and the remaining work is skipped.
+    static void set_cancel_flag(const std::atomic<uint32_t> *cancel)
+    {
+        s_cancel = cancel;
+        s_abandoned = false;
+    }
+    static bool cancelled()
+    {
+        if (s_cancel && s_cancel->load(std::memory_order_relaxed))
+        {
+            s_abandoned = true;
+            return true;
+        }
+        return false;
+    }
+
+    // True if a build stopped early since the flag was set, leaving the
+    // scenes incomplete
+    static bool abandoned()
+    {
+        return s_abandoned;
+    }
+
+    RTCBuildQuality quality = RTC_BUILD_QUALITY_LOW;
+    RTCSceneFlags flags = RTC_SCENE_FLAG_NONE;
+    bool dynamic = true;
+
+private:
+    static inline const std::atomic<uint32_t> *s_cancel = nullptr;
+    static inline std::atomic<bool> s_abandoned{false};
+};
+
+#endif // PROFILE_H
@@ -6,12 +6,34 @@
 
 #include "scene.h"
 #include <tbb/parallel_for_each.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+#include <tbb/info.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/concurrent_priority_queue.h>
+#include <OpenEXR/ImfOutputFile.h>
+#include <OpenEXR/ImfChannelList.h>
+#include <OpenEXR/ImfFrameBuffer.h>
+#include <OpenEXR/ImfHeader.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <condition_variable>
+#include <climits>
+#include <algorithm>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "tree.h"
 #include "terrain.h"
+#include "profile.h"
+#include "cache.h"
+#include "network.h"
+#include "denoise.h"
 #include "common.h"
+#include "ImathBox.h"
+#include "ImathFun.h"
 
 
 void errorFunction(void* userPtr, enum RTCError error, const char* str)
@@ -21,15 +43,28 @@ void errorFunction(void* userPtr, enum RTCError error, const char* str)
 
 std::atomic<ssize_t> s_embree_memory(0);
 
+// Allocations beyond the budget fail, which cancels the Embree operation
+// with an out of memory error. The bytes are still counted, since Embree
+// reports them as freed when it cleans up.
+std::atomic<ssize_t> s_memory_budget(0);
+std::atomic<bool> s_memory_exceeded(false);
+
 bool memoryFunction(void* userPtr, ssize_t bytes, bool post)
 {
     s_embree_memory += bytes;
+    if (bytes > 0 && !post && s_memory_budget > 0 && s_embree_memory > s_memory_budget)
+    {
+        s_memory_exceeded = true;
+        return false;
+    }
     return true;
 }
 
 SCENE::SCENE()
 {
-    device = rtcNewDevice("start_threads=1,set_affinity=1");
+    // Render threads are placed by the NUMA arenas, which Embree's own
+    // thread affinity would override
+    device = rtcNewDevice("start_threads=1");
 
     if (!device)
     {
@@ -56,70 +91,621 @@ SCENE::~SCENE()
 void SCENE::load(std::istream &is)
 {
     is >> json_scene;
+    m_dirty_state = ~0U;
+}
+
+void SCENE::load(const nlohmann::json &scene)
+{
+    json_scene = scene;
+    m_dirty_state = ~0U;
+}
+
+void SCENE::set_parameters(const nlohmann::json &json_ui)
+{
+    m_parameters.clear();
+    m_parameter_ids.clear();
+    for (const auto &json_p : json_ui)
+    {
+        UI_PARAMETER p;
+        p.name = json_p["name"].get<std::string>();
+        p.type = json_p["type"] == "int" ? INT_PARAMETER :
+                 json_p["type"] == "float" ? FLOAT_PARAMETER :
+                 json_p["type"] == "bool" ? BOOL_PARAMETER : STRING_PARAMETER;
+        p.vector_size = json_p.value("vector_size", 1);
+
+        // Colors are RGB float vectors
+        if (json_p["type"] == "color")
+        {
+            p.type = FLOAT_PARAMETER;
+            p.vector_size = 3;
+        }
+        m_parameter_ids[p.name] = m_parameters.size();
+        m_parameters.push_back(p);
+    }
+
+    auto add_dependency = [this](const std::string &name, unsigned geometry, unsigned state)
+    {
+        auto it = m_parameter_ids.find(name);
+        if (it != m_parameter_ids.end())
+        {
+            m_parameters[it->second].geometry |= geometry;
+            m_parameters[it->second].state |= state;
+        }
+    };
+    auto add_dependencies = [&](void (*publish_ui)(nlohmann::json &), unsigned geometry, unsigned state)
+    {
+        nlohmann::json json_ui = nlohmann::json::array();
+        publish_ui(json_ui);
+        for (const auto &json_p : json_ui)
+        {
+            add_dependency(json_p["name"], geometry, state);
+        }
+    };
+
+    add_dependencies(TERRAIN::publish_grid_ui, (1 << GROUND_GEOMETRY) | (1 << WATER_GEOMETRY), 0);
+    add_dependencies(TERRAIN::publish_ground_ui, 1 << GROUND_GEOMETRY, 0);
+    add_dependencies(TERRAIN::publish_water_ui, 1 << WATER_GEOMETRY, 0);
+
+    // Forests are built from trees, so share their parameters
+    add_dependencies(TREE::publish_ui, 1 << VEGETATION_GEOMETRY, 0);
+    add_dependencies(FOREST::publish_ui, 1 << VEGETATION_GEOMETRY, 0);
+
+    // The top level scene is created with the vegetation
+    add_dependency("render_profile", 1 << VEGETATION_GEOMETRY, 0);
+
+    // The budget may reduce the detail of any geometry
+    add_dependency("memory_budget", (1 << GEOMETRY_TYPE_COUNT) - 1, 0);
+
+    add_dependencies(BRDF::publish_ui, 0, SHADER_STATE);
+    add_dependencies(SUN_SKY_LIGHT::publish_ui, 0, LIGHT_STATE);
+    for (const auto &name : camera_parameters())
+    {
+        add_dependency(name, 0, CAMERA_STATE);
+    }
+
+    // Grid terrain and forest levels of detail follow the camera
+    auto add_lod_dependencies = [this](const std::vector<std::string> &names, unsigned geometry)
+    {
+        for (const auto &name : names)
+        {
+            auto it = m_parameter_ids.find(name);
+            if (it != m_parameter_ids.end())
+            {
+                m_parameters[it->second].lod_geometry |= geometry;
+            }
+        }
+    };
+    add_lod_dependencies(TERRAIN::camera_dependencies(), (1 << GROUND_GEOMETRY) | (1 << WATER_GEOMETRY));
+    add_lod_dependencies(FOREST::camera_dependencies(), 1 << FOREST_LOD_GEOMETRY);
 }
 
 void SCENE::update(std::istream &is)
 {
-    nlohmann::json json_updates;
-    is >> json_updates;
+    // Binary updates start with a tag that can't begin a JSON object
+    PARAM_UPDATE header;
+    is >> std::ws;
+    if (is.peek() != header.tag[0])
+    {
+        nlohmann::json json_updates;
+        is >> json_updates;
+        update(json_updates);
+        return;
+    }
+
+    const PARAM_UPDATE tag;
+    if (!is.read((char *)&header, sizeof(PARAM_UPDATE)) ||
+        memcmp(header.tag, tag.tag, sizeof(tag.tag)) || header.count < 0)
+    {
+        printf("Invalid parameter update\n");
+        return;
+    }
+    std::vector<PARAM_VALUE> values(header.count);
+    if (!is.read((char *)values.data(), values.size()*sizeof(PARAM_VALUE)))
+    {
+        printf("Invalid parameter update\n");
+        return;
+    }
+    update(values);
+}
 
+void SCENE::update(const nlohmann::json &json_updates)
+{
+    std::vector<int> ids;
     for (const auto &p : json_updates.items())
     {
         json_scene[p.key()] = p.value();
+
+        auto it = m_parameter_ids.find(p.key());
+        ids.push_back(it != m_parameter_ids.end() ? it->second : -1);
+    }
+    invalidate(ids);
+}
+
+void SCENE::update(const std::vector<PARAM_VALUE> &values)
+{
+    std::vector<int> ids;
+    for (const auto &v : values)
+    {
+        if (v.id < 0 || v.id >= (int)m_parameters.size() ||
+            v.component < 0 || v.component >= m_parameters[v.id].vector_size)
+        {
+            printf("Invalid parameter id %d[%d]\n", v.id, v.component);
+            continue;
+        }
+
+        const UI_PARAMETER &p = m_parameters[v.id];
+        nlohmann::json &value = p.vector_size > 1 ? json_scene[p.name][v.component] : json_scene[p.name];
+        switch (p.type)
+        {
+            case INT_PARAMETER: value = (int)lround(v.value); break;
+            case BOOL_PARAMETER: value = v.value != 0; break;
+            case FLOAT_PARAMETER: value = v.value; break;
+            case STRING_PARAMETER:
+                printf("Parameter %s is not numeric\n", p.name.c_str());
+                continue;
+        }
+        ids.push_back(v.id);
+    }
+    invalidate(ids);
+}
+
+void SCENE::invalidate(const std::vector<int> &ids)
+{
+    unsigned lod_mask = 0;
+    if (json_scene["terrain_mode"] == "grid" && TERRAIN::grid_lod_changed(m_terrain_camera, json_scene))
+    {
+        lod_mask |= (1 << GROUND_GEOMETRY) | (1 << WATER_GEOMETRY);
+    }
+    if (json_scene["forest_levels"] > 0.0F && json_scene["forest_lod"] > 1)
+    {
+        lod_mask |= 1 << FOREST_LOD_GEOMETRY;
+    }
+
+    m_camera_update = !ids.empty();
+    for (int id : ids)
+    {
+        if (id < 0)
+        {
+            m_camera_update = false;
+            continue;
+        }
+
+        const UI_PARAMETER &p = m_parameters[id];
+        m_dirty_geometry |= p.geometry | (p.lod_geometry & lod_mask);
+        m_dirty_state |= p.state;
+        if (!(p.state & CAMERA_STATE))
+        {
+            m_camera_update = false;
+        }
+    }
+}
+
+nlohmann::json SCENE::fit_memory_budget(nlohmann::json &parameters, unsigned rebuild) const
+{
+    const BUILD_PROFILE profile(parameters);
+    const bool rebuild_vegetation = rebuild & (1 << VEGETATION_GEOMETRY);
+    const bool rebuild_terrain = rebuild & ((1 << GROUND_GEOMETRY) | (1 << WATER_GEOMETRY));
+    auto estimate = [&]()
+    {
+        // Geometry that is kept uses the memory it was built with
+        nlohmann::json sizes = m_memory_estimate;
+        TERRAIN terrain(parameters);
+        if (rebuild & (1 << GROUND_GEOMETRY))
+        {
+            sizes["ground"] = parameters["enable_terrain"] ? terrain.surface_memory_estimate(profile) : 0;
+        }
+        if (rebuild & (1 << WATER_GEOMETRY))
+        {
+            sizes["water"] = parameters["enable_water"] ? terrain.surface_memory_estimate(profile) : 0;
+        }
+        if (rebuild_vegetation)
+        {
+            sizes["vegetation"] = parameters["forest_levels"] > 0.0F
+                                ? FOREST(parameters).memory_estimate()
+                                : TREE(TREE_PARAMS(parameters)).memory_estimate(profile);
+        }
+        return sizes;
+    };
+    auto total = [](const nlohmann::json &sizes)
+    {
+        size_t sum = 0;
+        for (const auto &s : sizes) sum += s.get<size_t>();
+        return sum;
+    };
+
+    nlohmann::json sizes = estimate();
+    double budget = parameters["memory_budget"].get<double>() * 1e6;
+    if (budget <= 0)
+    {
+        return sizes;
     }
 
-    // Crudely identify some parameters which require a scene rebuild
-    nlohmann::json geometry_affecting_parameters = nlohmann::json::array();
-    TERRAIN::publish_ui(geometry_affecting_parameters);
-    TREE::publish_ui(geometry_affecting_parameters);
-    FOREST::publish_ui(geometry_affecting_parameters);
+    // Give up detail in the larger of the rebuilt vegetation and terrain
+    // until the estimate fits. Trees are truncated to a coarser level of
+    // detail, then share fewer unique trees, before the terrain resolution
+    // drops. Geometry that isn't rebuilt can't give up any memory.
+    const int max_steps = 64;
+    for (int step = 0; step < max_steps && total(sizes) > budget; step++)
+    {
+        size_t vegetation = sizes["vegetation"];
+        size_t terrain = sizes["ground"].get<size_t>() + sizes["water"].get<size_t>();
+        float leaf_count = pow(10.0, parameters["levels"].get<float>());
+        float lod_leaf_count = parameters.value("lod_leaf_count", 1.0F);
+        bool grid = parameters["terrain_mode"] == "grid";
+        bool reduce_vegetation = rebuild_vegetation && (!rebuild_terrain || vegetation >= terrain);
+
+        if (reduce_vegetation && lod_leaf_count*4 <= leaf_count)
+        {
+            parameters["lod_leaf_count"] = lod_leaf_count*4;
+        }
+        else if (reduce_vegetation && parameters["forest_levels"] > 0.0F && parameters["unique_trees"] > 1)
+        {
+            parameters["unique_trees"] = parameters["unique_trees"].get<int>() - 1;
+        }
+        else if (rebuild_terrain && grid && parameters["terrain_detail"] > 0.01F)
+        {
+            parameters["terrain_detail"] = std::max(parameters["terrain_detail"].get<float>() * 0.7F, 0.01F);
+        }
+        else if (rebuild_terrain && !grid && parameters["terrain_levels"] > 0.0F)
+        {
+            parameters["terrain_levels"] = std::max(parameters["terrain_levels"].get<float>() - 0.25F, 0.0F);
+        }
+        else
+        {
+            break;
+        }
+        sizes = estimate();
+    }
 
-    for (const auto &geo_p : geometry_affecting_parameters)
+    if (total(sizes) > budget)
+    {
+        printf("Warning: estimated geometry memory %zuMb exceeds the %.0fMb budget\n",
+               total(sizes)/1000000, budget/1e6);
+    }
+    else if (parameters != json_scene)
     {
-        for (const auto &key_value : geo_p.items())
+        printf("Reduced detail to fit the %.0fMb memory budget:", budget/1e6);
+        for (const char *name : {"lod_leaf_count", "unique_trees", "terrain_detail", "terrain_levels"})
         {
-            if (key_value.key() == "name" && json_updates.find(key_value.value()) != json_updates.end())
+            if (parameters.value(name, nlohmann::json()) != json_scene.value(name, nlohmann::json()))
             {
-                clear_geometry();
-                break;
+                printf(" %s=%s", name, parameters[name].dump().c_str());
             }
         }
+        printf("\n");
     }
+    return sizes;
 }
 
 void SCENE::create_geometry()
 {
-    scene = rtcNewScene(device);
+    // Accumulate the build time and Embree memory of each subsystem
+    m_build_stats = nlohmann::json::object();
+    m_build_stats["memory"] = nlohmann::json::object();
+    auto lap_start = std::chrono::steady_clock::now();
+    ssize_t lap_memory = s_embree_memory;
+    auto lap = [&](const char *name)
+    {
+        auto now = std::chrono::steady_clock::now();
+        m_build_stats[name] = m_build_stats.value(name, 0.0) +
+                              std::chrono::duration<double>(now - lap_start).count();
+        lap_start = now;
+
+        ssize_t memory = s_embree_memory;
+        m_build_stats["memory"][name] = m_build_stats["memory"].value(name, (ssize_t)0) + memory - lap_memory;
+        lap_memory = memory;
+    };
+
+    // Only the bits of the geometry types are tracked, each cleared once
+    // that type is built
+    m_dirty_geometry &= (1 << GEOMETRY_TYPE_COUNT) - 1;
+
+    // When only the camera has moved, the forest keeps its trees and only
+    // reattaches the instances at their new levels of detail
+    const unsigned vegetation_mask = 1 << VEGETATION_GEOMETRY;
+    const unsigned forest_lod_mask = 1 << FOREST_LOD_GEOMETRY;
+    if (!scene || ((m_dirty_geometry & forest_lod_mask) && m_forest_trees.scenes.empty()))
+    {
+        m_dirty_geometry |= vegetation_mask;
+    }
+
+    // Build with reduced detail if the full detail geometry would exceed
+    // the memory budget
+    nlohmann::json parameters = json_scene;
+    m_memory_estimate = fit_memory_budget(parameters, scene ? m_dirty_geometry : ~0U);
+    m_build_stats["memory_estimate"] = m_memory_estimate;
+    s_memory_budget = (ssize_t)(json_scene["memory_budget"].get<double>() * 1e6);
+    s_memory_exceeded = false;
+
+    if (m_dirty_geometry & (vegetation_mask | forest_lod_mask))
+    {
+        // A forest may attach a very large number of instances, so rather
+        // than detaching them start a new scene, carrying over the terrain
+        // geometry that is still valid
+        RTCScene old_scene = scene;
+        std::vector<int> old_shader_index;
+        std::swap(old_shader_index, shader_index);
+        m_instances.clear();
+        m_instance_offsets.clear();
+
+        scene = BUILD_PROFILE(parameters).new_scene(device, true);
+
+        for (int type : {GROUND_GEOMETRY, WATER_GEOMETRY})
+        {
+            unsigned int &id = m_geometry_ids[type];
+            if (!old_scene)
+            {
+                m_dirty_geometry |= 1 << type;
+            }
+            else if (id != RTC_INVALID_GEOMETRY_ID && !(m_dirty_geometry & (1 << type)))
+            {
+                unsigned int new_id = rtcAttachGeometry(scene, rtcGetGeometry(old_scene, id));
+                BRDF::set_shader_index(shader_index, new_id, old_shader_index[id]);
+                id = new_id;
+            }
+            else
+            {
+                // Rebuilt below
+                if (id != RTC_INVALID_GEOMETRY_ID)
+                {
+                    GEOMETRY_CACHE::release(rtcGetGeometry(old_scene, id));
+                }
+                id = RTC_INVALID_GEOMETRY_ID;
+            }
+        }
+
+        if (old_scene)
+        {
+            rtcReleaseScene(old_scene);
+        }
+        lap("scene_setup");
+
+        const bool rebuild_trees = m_dirty_geometry & vegetation_mask;
+        if (rebuild_trees)
+        {
+            inst_shader_index.clear();
+            m_forest_trees.release();
+        }
+
+        // A cancelled build leaves the vegetation dirty. Forest trees that
+        // were complete before the cancel are kept for the instances.
+        if (parameters["forest_levels"] > 0.0F)
+        {
+            FOREST forest(parameters);
+            if (rebuild_trees)
+            {
+                forest.build_trees(device, inst_shader_index, shader_names, m_forest_trees);
+                lap("forest_trees");
+            }
+            if (BUILD_PROFILE::abandoned())
+            {
+                m_forest_trees.release();
+            }
+            else
+            {
+                m_dirty_geometry &= ~vegetation_mask;
+
+                FOREST_INSTANCES instances;
+                forest.embree_geometry(device, scene, m_forest_trees, instances);
+                if (!BUILD_PROFILE::abandoned())
+                {
+                    create_instance_table(instances);
+                    m_dirty_geometry &= ~forest_lod_mask;
+                }
+                lap("forest_geometry");
+            }
+        }
+        else
+        {
+            TREE tree{TREE_PARAMS(parameters)};
+
+            if (!tree.cached_geometry(device, scene, shader_index, shader_names))
+            {
+                tree.build();
+                lap("tree_build");
+                if (!BUILD_PROFILE::abandoned())
+                {
+                    tree.embree_geometry(device, scene, shader_index, shader_names);
+                }
+            }
+            if (!BUILD_PROFILE::abandoned())
+            {
+                m_dirty_geometry &= ~(vegetation_mask | forest_lod_mask);
+            }
+            lap("tree_geometry");
+        }
+    }
 
-    if (json_scene["forest_levels"] > 0.0F)
+    // Grid terrain stays at the camera it was built for until the view
+    // leaves what it covers, so that both surfaces follow the same camera
+    nlohmann::json terrain_parameters = parameters;
+    const unsigned terrain_mask = (1 << GROUND_GEOMETRY) | (1 << WATER_GEOMETRY);
+    if (parameters["terrain_mode"] == "grid" && (m_dirty_geometry & terrain_mask))
     {
-        FOREST forest(json_scene);
-        forest.embree_geometry(device, scene, inst_shader_index, shader_names);
+        if (TERRAIN::grid_lod_changed(m_terrain_camera, parameters))
+        {
+            m_terrain_camera = nlohmann::json::object();
+            for (const auto &name : TERRAIN::camera_dependencies())
+            {
+                m_terrain_camera[name] = parameters[name];
+            }
+            m_dirty_geometry |= terrain_mask;
+        }
+        for (const auto &name : TERRAIN::camera_dependencies())
+        {
+            terrain_parameters[name] = m_terrain_camera[name];
+        }
     }
-    else
+
+    for (int type : {GROUND_GEOMETRY, WATER_GEOMETRY})
+    {
+        // Geometry not yet built when the build is cancelled stays dirty
+        if (!(m_dirty_geometry & (1 << type)) || BUILD_PROFILE::abandoned())
+        {
+            continue;
+        }
+
+        unsigned int &id = m_geometry_ids[type];
+        if (id != RTC_INVALID_GEOMETRY_ID)
+        {
+            GEOMETRY_CACHE::release(rtcGetGeometry(scene, id));
+            rtcDetachGeometry(scene, id);
+            shader_index[id] = -1;
+        }
+
+        lap("scene_setup");
+
+        TERRAIN terrain(terrain_parameters);
+        if (type == GROUND_GEOMETRY)
+        {
+            id = terrain.ground_geometry(device, scene, shader_index, shader_names);
+            lap("ground_geometry");
+        }
+        else
+        {
+            id = terrain.water_geometry(device, scene, shader_index, shader_names);
+            lap("water_geometry");
+        }
+
+        // Terrain generation that was cancelled attaches nothing
+        if (!BUILD_PROFILE::abandoned())
+        {
+            m_dirty_geometry &= ~(1 << type);
+        }
+    }
+
+    // Quad terrain normals are interpolated directly from the buffers
+    m_smooth_normals.clear();
+    if (json_scene["terrain_mode"] != "grid")
+    {
+        for (int type : {GROUND_GEOMETRY, WATER_GEOMETRY})
+        {
+            unsigned int id = m_geometry_ids[type];
+            if (id == RTC_INVALID_GEOMETRY_ID)
+            {
+                continue;
+            }
+            RTCGeometry geom = rtcGetGeometry(scene, id);
+            if (m_smooth_normals.size() <= id)
+            {
+                m_smooth_normals.resize(id+1);
+            }
+            m_smooth_normals[id].indices = (const unsigned *)rtcGetGeometryBufferData(geom, RTC_BUFFER_TYPE_INDEX, 0);
+            m_smooth_normals[id].normals = (const Imath::V3f *)rtcGetGeometryBufferData(geom, RTC_BUFFER_TYPE_NORMAL, 0);
+        }
+    }
+
+    if (!BUILD_PROFILE::abandoned())
     {
-        TREE tree(json_scene);
+        rtcCommitScene(scene);
+    }
+    lap("commit_scene");
+
+    if (s_memory_exceeded)
+    {
+        // Any of the geometry may be incomplete, so start over next time
+        printf("Geometry build exceeded the memory budget\n");
+        rtcReleaseScene(scene);
+        scene = nullptr;
+        m_forest_trees.release();
+        GEOMETRY_CACHE::release_all();
+        std::fill(m_geometry_ids, m_geometry_ids + GEOMETRY_TYPE_COUNT, RTC_INVALID_GEOMETRY_ID);
+        m_dirty_geometry = ~0U;
+        m_scene_committed = false;
+        return;
+    }
 
-        tree.build();
-        tree.embree_geometry(device, scene, shader_index, shader_names);
+    // A cancelled build keeps the geometry that was completed, and the
+    // scene is committed once the rest is built
+    m_scene_committed = !BUILD_PROFILE::abandoned();
+    if (!m_scene_committed)
+    {
+        printf("Geometry build cancelled\n");
+        return;
+    }
+    m_build_stats["embree_memory"] = (ssize_t)s_embree_memory;
+
+    printf("Embree memory: %ldMb (", (ssize_t)s_embree_memory/1000000);
+    const char *separator = "";
+    for (const auto &p : m_build_stats["memory"].items())
+    {
+        if (p.value() != 0)
+        {
+            printf("%s%s %ldMb", separator, p.key().c_str(), p.value().get<ssize_t>()/1000000);
+            separator = ", ";
+        }
     }
+    printf(")\n");
+
+}
 
-    TERRAIN terrain(json_scene);
-    terrain.embree_geometry(device, scene, shader_index, shader_names);
+void SCENE::create_instance_table(const FOREST_INSTANCES &instances)
+{
+    // Instances are identified for color variation by their instance IDs,
+    // including the cell of clustered forests
+    const float inst_color_variance = 0.2F;
+
+    m_instance_offsets = instances.offsets;
+    m_instances.resize(instances.xforms.size());
+    for (unsigned int id = 0; id < instances.offsets.size(); id++)
+    {
+        if (instances.offsets[id] < 0)
+        {
+            continue;
+        }
 
-    rtcCommitScene(scene);
+        size_t begin = instances.offsets[id];
+        size_t end = instances.xforms.size();
+        for (unsigned int next = id+1; next < instances.offsets.size(); next++)
+        {
+            if (instances.offsets[next] >= 0)
+            {
+                end = instances.offsets[next];
+                break;
+            }
+        }
+        if (!instances.clustered)
+        {
+            end = begin+1;
+        }
 
-    printf("Embree memory: %ldMb\n", (ssize_t)s_embree_memory/1000000);
+        for (size_t i = begin; i < end; i++)
+        {
+            const Imath::M44f &m = instances.xforms[i];
+            unsigned int hash = id;
+            if (instances.clustered)
+            {
+                hash = id*0x9e3779b1U + (unsigned int)(i - begin);
+            }
 
+            INSTANCE_DATA &inst = m_instances[i];
+            inst.normal_xform = Imath::M33f(m[0][0], m[0][1], m[0][2],
+                                            m[1][0], m[1][1], m[1][2],
+                                            m[2][0], m[2][1], m[2][2]);
+            inst.color_offset = i_hash_eval(hash) * inst_color_variance;
+        }
+    }
 }
 
 void SCENE::clear_geometry()
 {
     rtcReleaseScene(scene);
     scene = nullptr;
+    m_forest_trees.release();
+    GEOMETRY_CACHE::release_all();
+    m_terrain_camera = nullptr;
 
     shader_index.clear();
     inst_shader_index.clear();
+    m_instances.clear();
+    m_instance_offsets.clear();
+    m_smooth_normals.clear();
+
+    for (auto &id : m_geometry_ids)
+    {
+        id = RTC_INVALID_GEOMETRY_ID;
+    }
+    m_dirty_geometry = ~0U;
 }
 
 static Imath::V3f json_to_vector(const nlohmann::json &vec)
@@ -127,6 +713,73 @@ static Imath::V3f json_to_vector(const nlohmann::json &vec)
     return Imath::V3f(vec[0], vec[1], vec[2]);
 }
 
+// Sobol direction numbers of Joe and Kuo (new-joe-kuo-6.21201) for the
+// dimensions after the first: degree s, coefficients a and initial m_i
+struct SOBOL_DIRECTIONS
+{
+    uint32_t s;
+    uint32_t a;
+    uint32_t m[5];
+};
+static const SOBOL_DIRECTIONS s_sobol_directions[] = {
+    {1, 0, {1}},
+    {2, 1, {1, 3}},
+    {3, 1, {1, 3, 1}},
+    {3, 2, {1, 1, 1}},
+    {4, 1, {1, 1, 3, 3}},
+    {4, 4, {1, 3, 5, 13}},
+    {5, 2, {1, 1, 5, 5, 17}},
+    {5, 4, {1, 1, 5, 5, 5}},
+    {5, 7, {1, 1, 7, 11, 19}}
+};
+static const int s_sobol_dimensions = 1 + sizeof(s_sobol_directions)/sizeof(SOBOL_DIRECTIONS);
+
+// Generator matrix columns of a Sobol dimension, most significant bit first
+static void sobol_matrix(int dim, uint32_t v[32])
+{
+    if (dim == 0)
+    {
+        for (int i = 0; i < 32; i++)
+        {
+            v[i] = 1U << (31-i);
+        }
+        return;
+    }
+
+    const SOBOL_DIRECTIONS &d = s_sobol_directions[dim-1];
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        if (i < d.s)
+        {
+            v[i] = d.m[i] << (31-i);
+            continue;
+        }
+        v[i] = v[i-d.s] ^ (v[i-d.s] >> d.s);
+        for (uint32_t k = 1; k < d.s; k++)
+        {
+            v[i] ^= ((d.a >> (d.s-1-k)) & 1) * v[i-k];
+        }
+    }
+}
+
+// Hash based nested uniform scrambling of the bits below each bit, from
+// Burley's "Practical Hash-based Owen Scrambling". Applied to bit reversed
+// values it's an Owen scramble.
+static inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x ^= x * 0x3d20adea;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56;
+    x ^= x * 0x53a22864;
+    return x;
+}
+
+static inline uint32_t hash_combine(uint32_t seed, uint32_t v)
+{
+    return seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
 void SCENE::fill_sample_caches()
 {
     // Generate a fixed size tile of random seeds to randomize sampling
@@ -147,6 +800,38 @@ void SCENE::fill_sample_caches()
         h.first = pixel_rand.nexti();
         h.second = pixel_rand.nexti();
     }
+
+    // Tabulate the Sobol points up to the sample count. Pixels scramble
+    // them with their hash, so the table only depends on the sample count
+    // and is kept across renders.
+    uint32_t bits = 0;
+    while ((1U << bits) < (uint32_t)std::max((int)json_scene["samples"], 1))
+    {
+        bits++;
+    }
+    if (m_sampler == SOBOL_SAMPLER && (bits != m_sobol_bits || m_sobol_table.empty()))
+    {
+        m_sobol_bits = bits;
+        const uint32_t size = 1U << bits;
+        m_sobol_table.resize(s_sobol_dimensions * size);
+        for (int dim = 0; dim < s_sobol_dimensions; dim++)
+        {
+            uint32_t v[32];
+            sobol_matrix(dim, v);
+
+            // Successive points differ by one column in Gray code order
+            uint32_t x = 0;
+            for (uint32_t i = 0; i < size; i++)
+            {
+                uint32_t gray = i ^ (i >> 1);
+                if (i > 0)
+                {
+                    x ^= v[__builtin_ctz(i)];
+                }
+                m_sobol_table[dim*size + gray] = x;
+            }
+        }
+    }
     // }
 
     // {
@@ -165,12 +850,8 @@ void SCENE::fill_sample_caches()
 }
 
 
-int SCENE::render()
+RES SCENE::get_res() const
 {
-    int outpipe_fd = json_scene["outpipe"];
-    int inpipe_fd =  json_scene["inpipe"];
-    int shm_fd = json_scene["shared_mem"];
-
     RES res;
     res.xres = json_scene["res"][0];
     res.yres = json_scene["res"][1];
@@ -182,119 +863,1326 @@ int SCENE::render()
     // threads
     res.nthreads = std::min(res.nthreads, res.tile_count());
 
-    if (res.shm_size() != m_shm_size)
+    res.float_buffer = json_scene["float_buffer"] ? 1 : 0;
+
+    // The preview pass renders one pixel per square of preview_scale
+    // pixels, which must evenly divide the tiles
+    int preview_scale = json_scene["preview_scale"];
+    while (preview_scale > 1 && res.tres % preview_scale)
     {
-        if (m_shared_data)
-        {
-            munmap(m_shared_data, m_shm_size);
-            m_shared_data = nullptr;
-        }
+        preview_scale--;
+    }
+    res.preview_scale = preview_scale > 1 ? preview_scale : 0;
 
-        m_shm_size = res.shm_size();
+    // ID shading modes are displayed without gamma correction
+    res.igamma = 1.0 / (float)json_scene["gamma"];
+    if (json_scene["shading"] != "physical")
+    {
+        res.igamma = 1.0;
+    }
+
+    return res;
+}
+
+bool SCENE::setup_arenas(int nthreads)
+{
+    if (nthreads == m_arena_threads && !m_arenas.empty())
+    {
+        return false;
+    }
+
+    // Without NUMA support in TBB there's a single automatic node
+    std::vector<tbb::numa_node_id> nodes = tbb::info::numa_nodes();
+    int ncores = 0;
+    for (auto node : nodes)
+    {
+        ncores += tbb::info::default_concurrency(node);
+    }
+
+    // Split the threads between the nodes by their core counts
+    m_arenas.clear();
+    int tid_offset = 0;
+    for (size_t i = 0; i < nodes.size() && tid_offset < nthreads; i++)
+    {
+        int count = nthreads - tid_offset;
+        if (i+1 < nodes.size())
+        {
+            count = std::min(std::max(nthreads * tbb::info::default_concurrency(nodes[i]) / ncores, 1), count);
+        }
+
+        // No slot is reserved for the main thread, which only joins an
+        // arena while waiting for it
+        NUMA_ARENA arena;
+        arena.arena = std::make_unique<tbb::task_arena>(tbb::task_arena::constraints(nodes[i], count), 0);
+        arena.tid_offset = tid_offset;
+        arena.nthreads = count;
+        m_arenas.push_back(std::move(arena));
+        tid_offset += count;
+    }
+    m_arena_threads = nthreads;
+
+    if (m_arenas.size() > 1)
+    {
+        printf("Rendering on %d NUMA nodes\n", (int)m_arenas.size());
+    }
+    return true;
+}
+
+void SCENE::run_arenas(const std::function<void(int)> &fn)
+{
+    if (m_arenas.size() == 1)
+    {
+        m_arenas[0].arena->execute([&] { fn(0); });
+        return;
+    }
+
+    std::vector<tbb::task_group> groups(m_arenas.size());
+    for (size_t i = 0; i < m_arenas.size(); i++)
+    {
+        m_arenas[i].arena->execute([&, i] { groups[i].run([&, i] { fn(i); }); });
+    }
+    for (size_t i = 0; i < m_arenas.size(); i++)
+    {
+        m_arenas[i].arena->execute([&, i] { groups[i].wait(); });
+    }
+}
+
+// Update a pixel of the image, which the GUI may be reading from the shared
+// float buffer. The count is negated while the color changes and the new
+// count is stored with release, so that the GUI can tell whether the color
+// it read goes with the count.
+static void publish_pixel(Imath::C3f &color, float &count,
+                          const Imath::C3f &new_color, float new_count)
+{
+    static_assert(std::atomic<float>::is_always_lock_free, "Shared counts must be lock free");
+    std::atomic<float> &shared_count = (std::atomic<float> &)count;
+    shared_count.store(-1.0F, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    color = new_color;
+    shared_count.store(new_count, std::memory_order_release);
+}
+
+void SCENE::setup_image(const RES &res)
+{
+    bool arenas_changed = setup_arenas(res.nthreads);
+
+    // Accumulate directly into shared memory when the GUI displays the
+    // float buffer
+    if (res.float_buffer && m_shared_data)
+    {
+        pixelcolors = (Imath::C3f *)m_shared_data;
+        samplecounts = (float *)((char *)m_shared_data + res.samples_offset());
+
+        // Clear the counts first, so the GUI treats the colors as unrendered
+        memset((void *)samplecounts, 0, res.pixel_count()*sizeof(float));
+        std::atomic_thread_fence(std::memory_order_release);
+        memset((void *)pixelcolors, 0, res.pixel_count()*sizeof(Imath::C3f));
+    }
+    else
+    {
+        // The buffers are left uninitialized so that their pages are first
+        // touched by the arena rendering their rows
+        if (arenas_changed || res.pixel_count() != m_image_pixels)
+        {
+            pixelcolors_buffer.reset(new Imath::C3f[res.pixel_count()]);
+            samplecounts_buffer.reset(new float[res.pixel_count()]);
+            m_image_pixels = res.pixel_count();
+        }
+        pixelcolors = pixelcolors_buffer.get();
+        samplecounts = samplecounts_buffer.get();
+
+        run_arenas([&](int arena)
+        {
+            for (int y = 0; y < res.yres; y++)
+            {
+                if (arena_of_row(y, res.yres) == arena)
+                {
+                    std::fill(pixelcolors + y*res.xres, pixelcolors + (y+1)*res.xres, Imath::C3f(0));
+                    std::fill(samplecounts + y*res.xres, samplecounts + (y+1)*res.xres, 0.0F);
+                }
+            }
+        });
+    }
+}
+
+const std::vector<std::string> &SCENE::camera_parameters()
+{
+    static const std::vector<std::string> names = {
+        "camera_pos", "camera_pitch", "camera_yaw", "camera_roll", "field_of_view"
+    };
+    return names;
+}
+
+Imath::M44f SCENE::camera_transform(const RES &res) const
+{
+    float aspect = (float)res.yres / (float)res.xres;
+    float fov = json_scene["field_of_view"];
+    fov = tan(radians(fov)/2.0F);
+    fov *= 2.0F;
+
+    Imath::M44f xform;
+    xform.scale(Imath::V3f(fov, 1.0, fov*aspect));
+    xform *= Imath::M44f().rotate(Imath::V3f(0, -radians(json_scene["camera_roll"]), 0));
+    xform *= Imath::M44f().rotate(Imath::V3f(radians(json_scene["camera_pitch"]), 0, 0));
+    xform *= Imath::M44f().rotate(Imath::V3f(0, 0, -radians(json_scene["camera_yaw"])));
+    xform *= Imath::M44f().translate(json_to_vector(json_scene["camera_pos"]));
+    return xform;
+}
+
+void SCENE::reproject_image(const Imath::M44f &camera_xform,
+                            std::vector<Imath::C3f> &image,
+                            std::vector<float> &depths) const
+{
+    const RES &res = m_res;
+    image.assign(res.pixel_count(), Imath::C3f(0));
+    depths.assign(res.pixel_count(), 0.0F);
+
+    // Splat the first hit of each pixel into the new view, keeping the
+    // nearest. Sky pixels are directions, so move only with the rotation.
+    const Imath::M44f inverse = camera_xform.inverse();
+    const float infinity = std::numeric_limits<float>::infinity();
+    for (size_t i = 0; i < res.pixel_count(); i++)
+    {
+        float depth = m_hit_depths[i];
+        if (depth <= 0 || samplecounts[i] <= 0)
+        {
+            continue;
+        }
+
+        Imath::V3f local;
+        if (depth == infinity)
+        {
+            inverse.multDirMatrix(m_hit_positions[i], local);
+        }
+        else
+        {
+            inverse.multVecMatrix(m_hit_positions[i], local);
+            depth = local[1];
+        }
+        if (local[1] <= 0)
+        {
+            continue;
+        }
+
+        int px = (int)floor(( local[0]/local[1] + 0.5F) * res.xres);
+        int py = (int)floor((-local[2]/local[1] + 0.5F) * res.yres);
+        if (px < 0 || px >= res.xres || py < 0 || py >= res.yres)
+        {
+            continue;
+        }
+
+        size_t ioff = (size_t)py*res.xres + px;
+        if (depths[ioff] == 0 || depth < depths[ioff])
+        {
+            depths[ioff] = depth;
+            image[ioff] = pixelcolors[i] / samplecounts[i];
+        }
+    }
+
+    // Pixels left empty are disoccluded, or cracks where the view has come
+    // closer to a surface. Fill the cracks from neighbours on the same
+    // surface, leaving the disocclusions to be rendered.
+    const std::vector<float> splat_depths = depths;
+    const std::vector<Imath::C3f> splat_image = image;
+    for (int y = 1; y < res.yres-1; y++)
+    {
+        for (int x = 1; x < res.xres-1; x++)
+        {
+            size_t ioff = (size_t)y*res.xres + x;
+            if (splat_depths[ioff] > 0)
+            {
+                continue;
+            }
+
+            float nearest = infinity;
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    float d = splat_depths[ioff + dy*res.xres + dx];
+                    if (d > 0) nearest = std::min(nearest, d);
+                }
+            }
+
+            int count = 0;
+            Imath::C3f sum(0);
+            for (int dy = -1; dy <= 1; dy++)
+            {
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    size_t noff = ioff + dy*res.xres + dx;
+                    float d = splat_depths[noff];
+                    if (d > 0 && d <= nearest * 1.05F)
+                    {
+                        sum += splat_image[noff];
+                        count++;
+                    }
+                }
+            }
+
+            if (count >= 4)
+            {
+                depths[ioff] = nearest;
+                image[ioff] = sum / count;
+            }
+        }
+    }
+}
+
+void SCENE::setup_render(const RES &res)
+{
+    if ((m_dirty_state & SHADER_STATE) || shaders.empty())
+    {
+        BRDF::create_shaders(json_scene, shaders, shader_names);
+    }
+
+    // NOTE: Needs to be called after create_shaders()
+    if (!scene || m_dirty_geometry || !m_scene_committed)
+    {
+        create_geometry();
+    }
+
+    if ((m_dirty_state & LIGHT_STATE) || !m_light)
+    {
+        m_light = std::make_unique<SUN_SKY_LIGHT>(json_scene);
+    }
+    m_dirty_state = 0;
+
+    // Carry the previous image over to the new view when only the camera
+    // has moved
+    const Imath::M44f camera_xform = camera_transform(res);
+    std::vector<Imath::C3f> reprojected;
+    std::vector<float> reprojected_depths;
+    m_reprojected = json_scene["reprojection"] && m_camera_update && !m_hit_depths.empty() &&
+                    res.xres == m_res.xres && res.yres == m_res.yres &&
+                    res.float_buffer == m_res.float_buffer;
+    if (m_reprojected)
+    {
+        reproject_image(camera_xform, reprojected, reprojected_depths);
+    }
+    m_camera_update = false;
+    m_camera_xform = camera_xform;
+    m_res = res;
+
+    setup_image(res);
+
+    // Seed the image with the reprojection. The first sample of each
+    // pixel replaces its estimate.
+    if (m_reprojected)
+    {
+        for (size_t i = 0; i < res.pixel_count(); i++)
+        {
+            bool valid = reprojected_depths[i] > 0;
+            publish_pixel(pixelcolors[i], samplecounts[i],
+                          valid ? reprojected[i] : Imath::C3f(0), valid ? 1.0F : 0.0F);
+            if (m_shared_data && !res.float_buffer)
+            {
+                auto clr = reprojected[i];
+                clr[0] = std::min(powf(std::max(clr[0], 0.0F), res.igamma), 1.0F);
+                clr[1] = std::min(powf(std::max(clr[1], 0.0F), res.igamma), 1.0F);
+                clr[2] = std::min(powf(std::max(clr[2], 0.0F), res.igamma), 1.0F);
+                m_shared_data[i] = valid ? Imath::rgb2packed(clr) : 0;
+            }
+        }
+    }
+
+    if (json_scene["reprojection"])
+    {
+        m_hit_positions.assign(res.pixel_count(), Imath::V3f(0));
+        m_hit_depths.assign(res.pixel_count(), 0.0F);
+    }
+    else
+    {
+        m_hit_positions.clear();
+        m_hit_depths.clear();
+    }
+
+    // Clear the preview so that the GUI can tell which pixels are done
+    if (res.preview_scale && m_shared_data)
+    {
+        memset((char *)m_shared_data + res.preview_offset(), 0, res.cancel_offset() - res.preview_offset());
+    }
+
+    // The denoiser is guided by the first hit albedo and normals
+    m_denoise = json_scene["denoise"];
+    if (m_denoise)
+    {
+        m_albedo.assign(res.pixel_count(), Imath::C3f(0));
+        m_normals.assign(res.pixel_count(), Imath::V3f(0));
+    }
+    else
+    {
+        m_albedo.clear();
+        m_normals.clear();
+    }
+
+    // Adaptive sampling stops tiles once the error estimate is below the
+    // threshold
+    m_adaptive_threshold = json_scene["adaptive_threshold"];
+    m_adaptive_min_samples = json_scene["adaptive_min_samples"];
+    if (m_adaptive_threshold > 0)
+    {
+        m_half_buffer.assign(res.pixel_count(), Imath::C3f(0));
+    }
+    else
+    {
+        m_half_buffer.clear();
+    }
+
+    // The ray buffers are allocated by render_tiles()
+    thread_data.resize(res.nthreads);
+    for (int i = 0; i < res.nthreads; i++)
+    {
+        rtcInitIntersectContext(&thread_data[i].context);
+        std::fill(thread_data[i].ray_counts, thread_data[i].ray_counts + RAY_TYPE_COUNT, 0);
+    }
+
+    m_sampler = json_scene["sampler"] == "sobol" ? SOBOL_SAMPLER : PAIR_SAMPLER;
+    fill_sample_caches();
+
+    m_shading_mode = PHYSICAL;
+    if (json_scene["shading"] == "geomID")
+    {
+        m_shading_mode = GEOM_ID;
+    }
+    else if (json_scene["shading"] == "primID")
+    {
+        m_shading_mode = PRIM_ID;
+    }
+    else if (json_scene["shading"] == "time")
+    {
+        m_shading_mode = TIME_HEATMAP;
+    }
+    else if (json_scene["shading"] == "rays")
+    {
+        m_shading_mode = RAYS_HEATMAP;
+    }
+
+    m_reflect_limit = json_scene["reflect_limit"];
+    m_ray_packets = json_scene["ray_packets"];
+    m_ray_sorting = json_scene["ray_sorting"];
+}
+
+int SCENE::render()
+{
+    int outpipe_fd = json_scene["outpipe"];
+    int inpipe_fd =  json_scene["inpipe"];
+    int shm_fd = json_scene["shared_mem"];
+
+    RES res = get_res();
+
+    if (res.shm_size() != m_shm_size)
+    {
+        if (m_shared_data)
+        {
+            munmap(m_shared_data, m_shm_size);
+            m_shared_data = nullptr;
+        }
+
+        m_shm_size = res.shm_size();
         if (ftruncate(shm_fd, m_shm_size) == -1)
         {
-            perror("ftruncate");
-            return 1;
+            perror("ftruncate");
+            return 1;
+        }
+
+        m_shared_data = (uint *)mmap(NULL, m_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (m_shared_data == MAP_FAILED)
+        {
+            perror("mmap");
+            return 1;
+        }
+    }
+
+    // The GUI may set the cancel flag while this render is in progress.
+    // It's cleared before the GUI learns of the render.
+    m_cancel = (std::atomic<uint32_t> *)((char *)m_shared_data + res.cancel_offset());
+    m_cancel->store(0);
+    BUILD_PROFILE::set_cancel_flag(m_cancel);
+
+    if (write(outpipe_fd, &res, sizeof(RES)) < 0)
+    {
+        perror("write");
+    }
+
+    // NOTE: Needs to be called after the write() above to avoid locking up the
+    // UI, since it may build geometry
+    setup_render(res);
+
+    // Discard any stop requests that arrived after the previous render
+    // finished, keeping the latest focus
+    fcntl(inpipe_fd, F_SETFL, fcntl(inpipe_fd, F_GETFL) | O_NONBLOCK);
+    REQUEST request;
+    auto handle_request = [&](bool allow_stop)
+    {
+        if (request.type == REQUEST::STOP)
+        {
+            return allow_stop;
+        }
+        if (request.type == REQUEST::FOCUS)
+        {
+            std::lock_guard<std::mutex> lock(m_focus_mutex);
+            m_focus_x = request.x;
+            m_focus_y = request.y;
+            m_focus_changed = true;
+        }
+        return false;
+    };
+    while (read(inpipe_fd, &request, sizeof(REQUEST)) == sizeof(REQUEST))
+    {
+        handle_request(false);
+    }
+
+    // Completed tiles are sent back to the GUI in batches, from whichever
+    // thread holds the lock once the notification interval has elapsed
+    tbb::concurrent_queue<TILE> completed;
+    std::mutex notify_mutex;
+    auto last_notify = std::chrono::steady_clock::now();
+    std::atomic<bool> stop(false);
+
+    auto notify = [&](bool force)
+    {
+        std::unique_lock<std::mutex> lock(notify_mutex, std::defer_lock);
+        if (force)
+        {
+            lock.lock();
+        }
+        else if (!lock.try_lock())
+        {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (!force && now - last_notify < std::chrono::milliseconds(20))
+        {
+            return;
+        }
+        last_notify = now;
+
+        // Writes of at most PIPE_BUF bytes are atomic, so the GUI never
+        // reads a partial TILE
+        const int max_batch = PIPE_BUF / sizeof(TILE);
+        std::vector<TILE> batch;
+        TILE tile;
+        while (completed.try_pop(tile))
+        {
+            batch.push_back(tile);
+            if (batch.size() == max_batch || completed.empty())
+            {
+                if (write(outpipe_fd, batch.data(), batch.size()*sizeof(TILE)) < 0)
+                {
+                    perror("write");
+                }
+                batch.clear();
+            }
+        }
+
+        while (read(inpipe_fd, &request, sizeof(REQUEST)) == sizeof(REQUEST))
+        {
+            if (handle_request(true))
+            {
+                stop = true;
+            }
+        }
+    };
+
+    // A tile covering the image tells the GUI to refresh it without
+    // adding samples
+    auto refresh_image = [&]()
+    {
+        TILE tile;
+        tile.xsize = res.xres;
+        tile.ysize = res.yres;
+        tile.sidx = res.nsamples;
+        tile.last = 1;
+        if (write(outpipe_fd, &tile, sizeof(TILE)) < 0)
+        {
+            perror("write");
+        }
+    };
+
+    // Show the reprojected image while the new samples come in
+    if (m_reprojected)
+    {
+        refresh_image();
+    }
+
+    // A cancelled or failed geometry build leaves nothing to render
+    int tcount = res.tile_count() * res.nsamples;
+    int tcomplete = (cancelled() || !scene || !m_scene_committed) ? 0 : render_tiles([&](const TILE &tile)
+    {
+        completed.push(tile);
+        notify(false);
+        return !stop;
+    });
+
+    notify(true);
+
+    // Show the denoised image once all samples are done
+    if (m_denoise && !stop && !cancelled() && m_shared_data)
+    {
+        display_denoised();
+        refresh_image();
+    }
+
+    // An empty tile tells the GUI that the renderer is idle
+    TILE tile;
+    if (write(outpipe_fd, &tile, sizeof(TILE)) < 0)
+    {
+        perror("write");
+    }
+
+    printf("Done %d / %d tiles\n", tcomplete, tcount);
+
+    return 0;
+}
+
+void SCENE::allocate_thread_data(int tid)
+{
+    // Called from the render thread so that the buffers are first touched
+    // on its NUMA node
+    const RES &res = m_res;
+    auto &td = thread_data[tid];
+    if (td.rayhits.size() != (size_t)(res.tres * res.tres))
+    {
+        td.rayhits = std::vector<RTCRayHit>(res.tres * res.tres);
+        td.occrays = std::vector<RTCRay>(res.tres * res.tres * 2);
+    }
+    td.shading_test.reserve(res.tres * res.tres);
+    td.shadow_test.reserve(res.tres * res.tres * 2);
+}
+
+int SCENE::render_tiles(const std::function<bool(const TILE &)> &tile_complete)
+{
+    const RES &res = m_res;
+
+    // Tiles are rendered in sample-major order, after the preview pass and
+    // nearest the focus point first. A tile is only queued again once its
+    // current sample completes, so two samples of the same tile never run
+    // at once.
+    struct QUEUED_TILE
+    {
+        TILE tile;
+        int64_t distance; // Squared distance to the focus point
+    };
+    struct TILE_ORDER
+    {
+        bool operator()(const QUEUED_TILE &qa, const QUEUED_TILE &qb) const
+        {
+            const TILE &a = qa.tile;
+            const TILE &b = qb.tile;
+            if (a.preview != b.preview) return a.preview < b.preview;
+            if (a.sidx != b.sidx) return a.sidx > b.sidx;
+            if (qa.distance != qb.distance) return qa.distance > qb.distance;
+            if (a.yoff != b.yoff) return a.yoff > b.yoff;
+            return a.xoff > b.xoff;
+        }
+    };
+    // Each arena queues the tiles of its own rows
+    std::vector<tbb::concurrent_priority_queue<QUEUED_TILE, TILE_ORDER>> queues(m_arenas.size());
+
+    // Threads with no tile to take sleep until one is queued or the render
+    // is over. Notifying under the lock ensures a wakeup can't be missed
+    // between a thread finding the queues empty and waiting.
+    std::mutex idle_mutex;
+    std::condition_variable tile_queued;
+    auto wake = [&](bool all)
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        if (all)
+        {
+            tile_queued.notify_all();
+        }
+        else
+        {
+            tile_queued.notify_one();
+        }
+    };
+    auto queues_empty = [&]()
+    {
+        return std::all_of(queues.begin(), queues.end(), [](const auto &queue) { return queue.empty(); });
+    };
+
+    int focus_x = -1;
+    int focus_y = -1;
+    auto push = [&](const TILE &tile)
+    {
+        int64_t distance = 0;
+        if (focus_x >= 0)
+        {
+            int64_t dx = tile.xoff + tile.xsize/2 - focus_x;
+            int64_t dy = tile.yoff + tile.ysize/2 - focus_y;
+            distance = dx*dx + dy*dy;
+        }
+        queues[arena_of_row(tile.yoff, res.yres)].push(QUEUED_TILE{tile, distance});
+        wake(false);
+    };
+    auto update_focus = [&]()
+    {
+        std::lock_guard<std::mutex> lock(m_focus_mutex);
+        focus_x = m_focus_x;
+        focus_y = m_focus_y;
+        m_focus_changed = false;
+    };
+    update_focus();
+
+    TILE tile;
+    tile.preview = res.preview_scale ? 1 : 0;
+    for (tile.yoff = 0; tile.yoff < res.yres; tile.yoff += res.tres)
+    {
+        for (tile.xoff = 0; tile.xoff < res.xres; tile.xoff += res.tres)
+        {
+            tile.xsize = std::min(res.xres - tile.xoff, res.tres);
+            tile.ysize = std::min(res.yres - tile.yoff, res.tres);
+            push(tile);
+        }
+    }
+
+    std::atomic<int> tiles_remaining(res.tile_count());
+    std::atomic<int> tcomplete(0);
+    std::atomic<bool> stop(false);
+
+    // Held while reordering so that pushes see a consistent focus
+    std::mutex focus_mutex;
+
+    // Take the best tile of all the bands by preview pass, sample index and
+    // focus distance, so that the bands stay in sample-major order and the
+    // focus applies across them. Ties go to the local band to keep the
+    // threads on their node's rows. The other candidates are queued again.
+    auto ahead = [](const QUEUED_TILE &a, const QUEUED_TILE &b)
+    {
+        if (a.tile.preview != b.tile.preview) return a.tile.preview > b.tile.preview;
+        if (a.tile.sidx != b.tile.sidx) return a.tile.sidx < b.tile.sidx;
+        return a.distance < b.distance;
+    };
+    auto pop = [&](int arena, QUEUED_TILE &qtile)
+    {
+        bool found = false;
+        for (size_t i = 0; i < queues.size(); i++)
+        {
+            QUEUED_TILE candidate;
+            if (!queues[(arena + i) % queues.size()].try_pop(candidate))
+            {
+                continue;
+            }
+            if (!found)
+            {
+                qtile = candidate;
+                found = true;
+                continue;
+            }
+            if (ahead(candidate, qtile))
+            {
+                std::swap(candidate, qtile);
+            }
+            std::lock_guard<std::mutex> lock(focus_mutex);
+            push(candidate.tile);
+        }
+        return found;
+    };
+
+    // The arenas limit their worker count so that the arena slot offset by
+    // the arena's first thread can index the per-thread data. Note the use
+    // of grain size == 1 and simple_partitioner below to ensure we get
+    // exactly nthreads tasks in each arena.
+    run_arenas([&](int arena)
+    {
+        tbb::parallel_for(tbb::blocked_range<int>(0,m_arenas[arena].nthreads,1),
+                          [&](tbb::blocked_range<int>)
+        {
+            const int tid = m_arenas[arena].tid_offset + tbb::this_task_arena::current_thread_index();
+            allocate_thread_data(tid);
+
+            while (!stop)
+            {
+                // Reorder the queued tiles for a new focus point. Tiles
+                // popped meanwhile by other threads are requeued as usual.
+                if (m_focus_changed && focus_mutex.try_lock())
+                {
+                    std::vector<QUEUED_TILE> queued;
+                    QUEUED_TILE qtile;
+                    for (auto &queue : queues)
+                    {
+                        while (queue.try_pop(qtile))
+                        {
+                            queued.push_back(qtile);
+                        }
+                    }
+                    update_focus();
+                    for (const auto &q : queued)
+                    {
+                        push(q.tile);
+                    }
+                    focus_mutex.unlock();
+                }
+
+                QUEUED_TILE qtile;
+                if (!pop(arena, qtile))
+                {
+                    // Other threads may still requeue their tiles
+                    std::unique_lock<std::mutex> lock(idle_mutex);
+                    tile_queued.wait(lock, [&] { return stop || !tiles_remaining || !queues_empty(); });
+                    if (!tiles_remaining) break;
+                    continue;
+                }
+
+                TILE tile = qtile.tile;
+                tile.tid = tid;
+                if (!render_tile(tile))
+                {
+                    stop = true;
+                    wake(true);
+                    break;
+                }
+
+                if (tile.preview)
+                {
+                    // Continue with the first sample at full resolution
+                    tile.last = 0;
+                    if (!tile_complete(tile))
+                    {
+                        stop = true;
+                        wake(true);
+                    }
+                    tile.preview = 0;
+                    std::lock_guard<std::mutex> lock(focus_mutex);
+                    push(tile);
+                    continue;
+                }
+                tcomplete++;
+
+                // Converged tiles leave the queue early so the remaining
+                // threads move on to the unconverged tiles
+                bool converged = tile.sidx+1 >= m_adaptive_min_samples &&
+                                 tile.error < m_adaptive_threshold;
+                tile.last = converged || tile.sidx+1 >= res.nsamples;
+
+                if (!tile_complete(tile))
+                {
+                    stop = true;
+                    wake(true);
+                }
+
+                tile.sidx++;
+                if (!tile.last)
+                {
+                    std::lock_guard<std::mutex> lock(focus_mutex);
+                    push(tile);
+                }
+                else if (--tiles_remaining == 0)
+                {
+                    wake(true);
+                }
+            }
+        }, tbb::simple_partitioner());
+    });
+
+    return tcomplete;
+}
+
+int SCENE::render_batch(const std::string &filename, nlohmann::json *stats)
+{
+    if (!render_frame(stats))
+    {
+        return 1;
+    }
+    return save_image(filename) ? 0 : 1;
+}
+
+bool SCENE::render_frame(nlohmann::json *stats)
+{
+    RES res = get_res();
+
+    // There is no display to show a preview
+    res.preview_scale = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Build stats are only for geometry rebuilt by this frame
+    m_build_stats = nlohmann::json::object();
+    setup_render(res);
+    if (!scene)
+    {
+        fprintf(stderr, "Error: could not build the scene geometry\n");
+        return false;
+    }
+
+    auto render_start = std::chrono::steady_clock::now();
+
+    int tcomplete = render_tiles([](const TILE &) { return true; });
+
+    auto end = std::chrono::steady_clock::now();
+    printf("Setup %.3fs, rendered %d of %d tile samples in %.3fs\n",
+            std::chrono::duration<double>(render_start - start).count(),
+            tcomplete, res.tile_count() * res.nsamples,
+            std::chrono::duration<double>(end - render_start).count());
+
+    if (stats)
+    {
+        double render_time = std::chrono::duration<double>(end - render_start).count();
+
+        uint64_t rays[RAY_TYPE_COUNT] = {0};
+        for (const auto &td : thread_data)
+        {
+            for (int i = 0; i < RAY_TYPE_COUNT; i++)
+            {
+                rays[i] += td.ray_counts[i];
+            }
+        }
+
+        const char *ray_names[RAY_TYPE_COUNT] = {"primary", "reflection", "shadow"};
+        nlohmann::json json_rays;
+        nlohmann::json json_rays_per_sec;
+        for (int i = 0; i < RAY_TYPE_COUNT; i++)
+        {
+            json_rays[ray_names[i]] = rays[i];
+            json_rays_per_sec[ray_names[i]] = rays[i] / render_time;
+        }
+
+        (*stats)["build"] = m_build_stats;
+        (*stats)["setup_time"] = std::chrono::duration<double>(render_start - start).count();
+        (*stats)["render_time"] = render_time;
+        (*stats)["nthreads"] = res.nthreads;
+        (*stats)["rays"] = json_rays;
+        (*stats)["rays_per_sec"] = json_rays_per_sec;
+    }
+
+    return true;
+}
+
+nlohmann::json SCENE::sequence_frame(const nlohmann::json &sequence, int frame)
+{
+    // Each parameter is interpolated between the keys that set it, and
+    // held before the first and after the last. Numbers and vectors are
+    // interpolated linearly, and other values step at each key.
+    nlohmann::json parameters = nlohmann::json::object();
+    const nlohmann::json &keys = sequence["keys"];
+    for (const auto &key : keys)
+    {
+        for (const auto &p : key.items())
+        {
+            const std::string &name = p.key();
+            if (name == "frame" || parameters.contains(name))
+            {
+                continue;
+            }
+
+            const nlohmann::json *prev = nullptr;
+            const nlohmann::json *next = nullptr;
+            int prev_frame = 0;
+            int next_frame = 0;
+            for (const auto &k : keys)
+            {
+                if (!k.contains(name))
+                {
+                    continue;
+                }
+                int f = k["frame"];
+                if (f <= frame && (!prev || f >= prev_frame))
+                {
+                    prev = &k[name];
+                    prev_frame = f;
+                }
+                if (f > frame && (!next || f < next_frame))
+                {
+                    next = &k[name];
+                    next_frame = f;
+                }
+            }
+
+            if (!prev || !next)
+            {
+                parameters[name] = prev ? *prev : *next;
+                continue;
+            }
+
+            float t = (float)(frame - prev_frame) / (float)(next_frame - prev_frame);
+            auto lerp = [t](const nlohmann::json &a, const nlohmann::json &b)
+            {
+                if (a.is_number_integer() && b.is_number_integer())
+                {
+                    return nlohmann::json((int)round(Imath::lerp(a.get<float>(), b.get<float>(), t)));
+                }
+                return nlohmann::json(Imath::lerp(a.get<float>(), b.get<float>(), t));
+            };
+
+            if (prev->is_number() && next->is_number())
+            {
+                parameters[name] = lerp(*prev, *next);
+            }
+            else if (prev->is_array() && next->is_array() && prev->size() == next->size())
+            {
+                nlohmann::json value = nlohmann::json::array();
+                for (size_t i = 0; i < prev->size(); i++)
+                {
+                    value.push_back((*prev)[i].is_number() ? lerp((*prev)[i], (*next)[i]) : (*prev)[i]);
+                }
+                parameters[name] = value;
+            }
+            else
+            {
+                parameters[name] = *prev;
+            }
+        }
+    }
+    return parameters;
+}
+
+// Expand a printf style frame number in the output pattern, or insert one
+// before the extension
+static std::string frame_filename(const std::string &pattern, int frame)
+{
+    size_t pos = pattern.find('%');
+    size_t end = pos == std::string::npos ? pos : pattern.find('d', pos);
+    if (end == std::string::npos ||
+        pattern.find_first_not_of("0123456789", pos+1) != end)
+    {
+        size_t dot = pattern.rfind('.');
+        std::string number = std::to_string(frame);
+        number.insert(0, std::max(4 - (int)number.size(), 0), '0');
+        return dot == std::string::npos ? pattern + "." + number
+                                        : pattern.substr(0, dot) + "." + number + pattern.substr(dot);
+    }
+
+    char number[32];
+    snprintf(number, sizeof(number), pattern.substr(pos, end-pos+1).c_str(), frame);
+    return pattern.substr(0, pos) + number + pattern.substr(end+1);
+}
+
+int SCENE::render_sequence(const std::string &pattern, const nlohmann::json &sequence,
+                           const std::function<void(int, const nlohmann::json &)> &frame_stats)
+{
+    int frames = sequence.value("frames", 0);
+    for (const auto &key : sequence["keys"])
+    {
+        frames = std::max(frames, key["frame"].get<int>() + 1);
+    }
+
+    // Frames are encoded and written on a background thread so that the
+    // next frame builds and renders meanwhile. A large frame with its AOVs
+    // can take more than a gigabyte, so the renderer waits for the writer
+    // once max_queued frames are pending.
+    struct FRAME
+    {
+        std::string filename;
+        int xres = 0;
+        int yres = 0;
+        std::vector<Imath::C3f> image;
+        std::vector<Imath::C3f> albedo;
+        std::vector<Imath::V3f> normals;
+    };
+    const size_t max_queued = 2;
+    std::deque<FRAME> queue;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable space;
+    bool done = false;
+    bool error = false;
+
+    std::thread writer([&]
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            ready.wait(lock, [&] { return done || !queue.empty(); });
+            if (queue.empty())
+            {
+                break;
+            }
+            FRAME frame = std::move(queue.front());
+            queue.pop_front();
+            space.notify_one();
+
+            lock.unlock();
+            bool ok = write_image(frame.filename, frame.xres, frame.yres,
+                                  frame.image, frame.albedo, frame.normals);
+            lock.lock();
+            error = error || !ok;
+        }
+    });
+
+    int rval = 0;
+    nlohmann::json previous = nlohmann::json::object();
+    for (int frame = 0; frame < frames && !rval; frame++)
+    {
+        // Only the parameters that change are updated, so the geometry that
+        // doesn't depend on them is kept
+        nlohmann::json parameters = sequence_frame(sequence, frame);
+        nlohmann::json changes = nlohmann::json::object();
+        for (const auto &p : parameters.items())
+        {
+            if (previous.value(p.key(), nlohmann::json()) != p.value())
+            {
+                changes[p.key()] = p.value();
+            }
+        }
+        previous = parameters;
+        if (!changes.empty())
+        {
+            update(changes);
         }
 
-        m_shared_data = (uint *)mmap(NULL, m_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-        if (m_shared_data == MAP_FAILED)
+        printf("Frame %d of %d\n", frame+1, frames);
+        nlohmann::json stats;
+        if (!render_frame(&stats))
         {
-            perror("mmap");
-            return 1;
+            rval = 1;
+            break;
         }
+        stats["frame"] = frame;
+        frame_stats(frame, stats);
+
+        FRAME output;
+        output.filename = frame_filename(pattern, frame);
+        output.xres = m_res.xres;
+        output.yres = m_res.yres;
+        resolve_image(output.image, output.albedo, output.normals);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        space.wait(lock, [&] { return queue.size() < max_queued; });
+        queue.push_back(std::move(output));
+        ready.notify_one();
     }
 
-    if (write(outpipe_fd, &res, sizeof(RES)) < 0)
     {
-        perror("write");
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        ready.notify_one();
     }
+    writer.join();
 
-    BRDF::create_shaders(json_scene, shaders, shader_names);
+    return (rval || error) ? 1 : 0;
+}
 
-    // NOTE: Needs to be called after the write() above to avoid locking up the
-    // UI. Also needs to be called after create_shaders()
-    if (!scene)
+int SCENE::render_coordinator(const std::string &filename, int port, int chunk_samples)
+{
+    RES res = get_res();
+    res.preview_scale = 0;
+    m_res = res;
+    setup_image(res);
+
+    // Workers render fixed ranges of samples, so adaptive sampling is off
+    nlohmann::json worker_scene = json_scene;
+    worker_scene["adaptive_threshold"] = 0;
+
+    // Workers only return colors, so the gathered image is denoised
+    // without the albedo and normal guides
+    m_denoise = json_scene["denoise"];
+    m_albedo.clear();
+    m_normals.clear();
+    worker_scene["denoise"] = false;
+    if (m_denoise)
     {
-        create_geometry();
+        printf("Denoising without albedo and normals on distributed renders\n");
     }
 
-    SUN_SKY_LIGHT light(json_scene);
+    auto start = std::chrono::steady_clock::now();
+
+    bool complete = coordinate_render(port, worker_scene, res, chunk_samples,
+                                      [&](const NET_WORK &work, const Imath::C3f *colors)
+    {
+        const TILE &tile = work.tile;
+        for (int y = 0; y < tile.ysize; y++)
+        {
+            int ioff = (y + tile.yoff) * res.xres + tile.xoff;
+            for (int x = 0; x < tile.xsize; x++)
+            {
+                publish_pixel(pixelcolors[ioff + x], samplecounts[ioff + x],
+                              pixelcolors[ioff + x] + colors[y*tile.xsize + x],
+                              samplecounts[ioff + x] + work.count);
+            }
+        }
+    });
 
-    pixelcolors.assign(res.xres * res.yres, Imath::C3f(0));
+    auto end = std::chrono::steady_clock::now();
+    printf("Rendered %d tile samples in %.3fs\n", res.tile_count() * res.nsamples,
+            std::chrono::duration<double>(end - start).count());
 
-    thread_data.resize(res.nthreads);
-    for (int i = 0; i < res.nthreads; i++)
+    if (!complete)
     {
-        thread_data[i].rayhits.resize(res.tres * res.tres);
-        thread_data[i].occrays.resize(res.tres * res.tres * 2);
-        thread_data[i].shading_test.reserve(res.tres * res.tres);
-        thread_data[i].shadow_test.reserve(res.tres * res.tres * 2);
-        rtcInitIntersectContext(&thread_data[i].context);
+        return 1;
     }
+    return save_image(filename) ? 0 : 1;
+}
 
-    fill_sample_caches();
+int SCENE::render_worker(const std::string &address, int nthreads, float memory_budget)
+{
+    auto load = [&](const nlohmann::json &json_scene_in)
+    {
+        // Use the threads and memory of this machine rather than the
+        // coordinator's
+        json_scene = json_scene_in;
+        m_dirty_state = ~0U;
+        json_scene["nthreads"] = nthreads > 0 ? nthreads : (int)std::thread::hardware_concurrency();
+        if (memory_budget > 0)
+        {
+            json_scene["memory_budget"] = memory_budget;
+        }
 
-    float aspect = (float)res.yres / (float)res.xres;
-    float fov = json_scene["field_of_view"];
-    fov = tan(radians(fov)/2.0F);
-    fov *= 2.0F;
+        RES res = get_res();
+        res.preview_scale = 0;
+        setup_render(res);
+        if (!scene)
+        {
+            res.nthreads = 0;
+        }
+        return res;
+    };
 
-    Imath::M44f camera_xform;
-    camera_xform.scale(Imath::V3f(fov, 1.0, fov*aspect));
-    camera_xform *= Imath::M44f().rotate(Imath::V3f(0, -radians(json_scene["camera_roll"]), 0));
-    camera_xform *= Imath::M44f().rotate(Imath::V3f(radians(json_scene["camera_pitch"]), 0, 0));
-    camera_xform *= Imath::M44f().rotate(Imath::V3f(0, 0, -radians(json_scene["camera_yaw"])));
-    camera_xform *= Imath::M44f().translate(json_to_vector(json_scene["camera_pos"]));
+    // Tiles are rendered into the local image, which is only used as
+    // scratch space since each tile has one range of samples out at a time
+    auto render = [&](const NET_WORK &work, int tid, std::vector<Imath::C3f> &colors)
+    {
+        allocate_thread_data(tid);
+        TILE tile = work.tile;
+        tile.tid = tid;
+        tile.preview = 0;
+        for (int s = 0; s < work.count; s++)
+        {
+            tile.sidx = work.tile.sidx + s;
+            render_tile(tile);
+        }
 
-    float igamma = 1.0 / (float)json_scene["gamma"];
+        colors.resize(tile.xsize*tile.ysize);
+        for (int y = 0; y < tile.ysize; y++)
+        {
+            Imath::C3f *row = pixelcolors + (y + tile.yoff) * m_res.xres + tile.xoff;
+            std::copy(row, row + tile.xsize, colors.begin() + y*tile.xsize);
+            std::fill(row, row + tile.xsize, Imath::C3f(0));
+        }
+    };
 
-    int tcount = res.tile_count() * res.nsamples;
-    std::atomic<int> tcomplete(0);
+    return run_worker(address, load, render) ? 0 : 1;
+}
 
-    SHADING_MODE shading_mode = PHYSICAL;
-    if (json_scene["shading"] == "geomID")
+void SCENE::resolve_image(std::vector<Imath::C3f> &image,
+                          std::vector<Imath::C3f> &albedo,
+                          std::vector<Imath::V3f> &normals) const
+{
+    // Normalize by the per-pixel sample count since adaptive sampling may
+    // stop tiles early
+    image.resize(m_res.pixel_count());
+    albedo.resize(m_albedo.size());
+    normals.resize(m_normals.size());
+    for (size_t i = 0; i < image.size(); i++)
     {
-        shading_mode = GEOM_ID;
-        igamma = 1.0;
+        float scale = 1.0F / std::max(samplecounts[i], 1.0F);
+        image[i] = pixelcolors[i] * scale;
+        if (!albedo.empty())
+        {
+            albedo[i] = m_albedo[i] * scale;
+            normals[i] = m_normals[i] * scale;
+        }
     }
-    else if (json_scene["shading"] == "primID")
+
+    if (m_denoise)
     {
-        shading_mode = PRIM_ID;
-        igamma = 1.0;
+        std::vector<Imath::C3f> denoised(image.size());
+        if (denoise_image(m_res.xres, m_res.yres, image.data(),
+                          albedo.empty() ? nullptr : albedo.data(),
+                          normals.empty() ? nullptr : normals.data(), denoised.data()))
+        {
+            image.swap(denoised);
+        }
     }
+}
 
-    int reflect_limit = json_scene["reflect_limit"];
+bool SCENE::save_image(const std::string &filename) const
+{
+    std::vector<Imath::C3f> image;
+    std::vector<Imath::C3f> albedo;
+    std::vector<Imath::V3f> normals;
+    resolve_image(image, albedo, normals);
+    return write_image(filename, m_res.xres, m_res.yres, image, albedo, normals);
+}
 
-    // Note the use of grain size == 1 and simple_partitioner below to ensure
-    // we get exactly nthreads tasks
-    tbb::parallel_for(tbb::blocked_range<int>(0,res.nthreads,1),
-                       [&](tbb::blocked_range<int>)
+bool SCENE::write_image(const std::string &filename, int xres, int yres,
+                        const std::vector<Imath::C3f> &image,
+                        const std::vector<Imath::C3f> &albedo,
+                        const std::vector<Imath::V3f> &normals)
+{
+    // Write the linear float image, with the denoiser AOVs when available
+    try
     {
-        while (1)
+        Imf::Header header(xres, yres);
+        Imf::FrameBuffer fb;
+        size_t xstride = sizeof(Imath::C3f);
+        size_t ystride = xstride * xres;
+        auto add_channels = [&](const void *data, const char *names[3])
         {
-            TILE tile;
-            if (read(inpipe_fd, &tile, sizeof(TILE)) < 0)
+            for (int c = 0; c < 3; c++)
             {
-                perror("read");
+                header.channels().insert(names[c], Imf::Channel(Imf::FLOAT));
+                fb.insert(names[c], Imf::Slice(Imf::FLOAT, (char *)data + c*sizeof(float), xstride, ystride));
             }
+        };
 
-            if (tile.xsize == 0) break;
+        const char *rgb[3] = {"R", "G", "B"};
+        add_channels(image.data(), rgb);
+        if (!albedo.empty())
+        {
+            const char *albedo_names[3] = {"albedo.R", "albedo.G", "albedo.B"};
+            const char *normal_names[3] = {"N.X", "N.Y", "N.Z"};
+            add_channels(albedo.data(), albedo_names);
+            add_channels(normals.data(), normal_names);
+        }
 
-            render_tile(tile, res, light, camera_xform, igamma, shading_mode, reflect_limit);
+        Imf::OutputFile file(filename.c_str(), header);
+        file.setFrameBuffer(fb);
+        file.writePixels(yres);
+    }
+    catch (const std::exception &e)
+    {
+        fprintf(stderr, "Error writing %s: %s\n", filename.c_str(), e.what());
+        return false;
+    }
 
-            if (write(outpipe_fd, &tile, sizeof(TILE)) < 0)
-            {
-                perror("write");
-            }
+    return true;
+}
 
-            tcomplete++;
-        }
-    }, tbb::simple_partitioner());
+void SCENE::display_denoised()
+{
+    std::vector<Imath::C3f> image;
+    std::vector<Imath::C3f> albedo;
+    std::vector<Imath::V3f> normals;
+    resolve_image(image, albedo, normals);
 
-    printf("Done %d / %d tiles\n", (int)tcomplete, tcount);
+    const RES &res = m_res;
+    if (res.float_buffer)
+    {
+        // The shared float buffer becomes a display buffer for the denoised
+        // image, and the raw sums move to the local buffers so that
+        // reprojection and any further accumulation start from radiance
+        if (m_image_pixels != res.pixel_count())
+        {
+            pixelcolors_buffer.reset(new Imath::C3f[res.pixel_count()]);
+            samplecounts_buffer.reset(new float[res.pixel_count()]);
+            m_image_pixels = res.pixel_count();
+        }
+        Imath::C3f *display = pixelcolors;
+        float *display_counts = samplecounts;
+        std::copy(pixelcolors, pixelcolors + image.size(), pixelcolors_buffer.get());
+        std::copy(samplecounts, samplecounts + image.size(), samplecounts_buffer.get());
+        pixelcolors = pixelcolors_buffer.get();
+        samplecounts = samplecounts_buffer.get();
+
+        // The float buffer holds sums, so scale back up by the sample counts
+        for (size_t i = 0; i < image.size(); i++)
+        {
+            publish_pixel(display[i], display_counts[i],
+                          image[i] * samplecounts[i], samplecounts[i]);
+        }
+        return;
+    }
 
-    return 0;
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        auto clr = image[i];
+        clr[0] = std::min(powf(std::max(clr[0], 0.0F), res.igamma), 1.0F);
+        clr[1] = std::min(powf(std::max(clr[1], 0.0F), res.igamma), 1.0F);
+        clr[2] = std::min(powf(std::max(clr[2], 0.0F), res.igamma), 1.0F);
+        m_shared_data[i] = Imath::rgb2packed(clr);
+    }
 }
 
 inline float sample_to_float(uint32_t n, uint32_t seed)
@@ -323,6 +2211,41 @@ inline uint32_t vandercorput(uint32_t n)
     return n;
 }
 
+inline void SCENE::sample_pair(int px, int py, uint32_t sidx, uint32_t isx, uint32_t isy,
+                               int dim, float &sx, float &sy) const
+{
+    auto [h_ioffx,h_ioffy] = p_hash_eval(px, py);
+    if (m_sampler != SOBOL_SAMPLER)
+    {
+        sx = sample_to_float(h_ioffx ^ isx, seeds[dim]);
+        sy = sample_to_float(h_ioffy ^ isy, seeds[dim+1]);
+        return;
+    }
+
+    // Each pixel visits the table in its own nested uniform shuffle, so
+    // that any power of 2 prefix of its samples is still a net. Samples
+    // past the table continue with a new shuffle.
+    const uint32_t size_mask = (1U << m_sobol_bits) - 1;
+    uint32_t seed = hash_combine(h_ioffx, sidx >> m_sobol_bits);
+    uint32_t index = vandercorput(laine_karras_permutation(vandercorput(sidx & size_mask), seed)) & size_mask;
+
+    // Dimensions past the table repeat the reflection level dimensions
+    // with their own scrambles
+    auto sample = [&](int d)
+    {
+        int table_dim = d;
+        if (table_dim >= s_sobol_dimensions)
+        {
+            table_dim = BRDF_SAMPLE + (d - BRDF_SAMPLE) % (s_sobol_dimensions - BRDF_SAMPLE);
+        }
+        uint32_t x = m_sobol_table[(table_dim << m_sobol_bits) + index];
+        x = vandercorput(laine_karras_permutation(vandercorput(x), hash_combine(h_ioffy, d)));
+        return (float)x / (float)0x100000000LL;
+    };
+    sx = sample(dim);
+    sy = sample(dim+1);
+}
+
 static inline void init_ray(RTCRay &ray, const Imath::V3f &org, const Imath::V3f &dir)
 {
     ray.org_x = org[0];
@@ -344,49 +2267,257 @@ static inline void init_rayhit(RTCRayHit &rayhit, const Imath::V3f &org, const I
     rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
 }
 
-void SCENE::render_tile(const TILE &tile, const RES &res, const SUN_SKY_LIGHT &light, const Imath::M44f &camera_xform, float igamma, SHADING_MODE shading_mode, int reflect_limit)
+static inline const RTCRay &get_ray(const RTCRay &ray) { return ray; }
+static inline const RTCRay &get_ray(const RTCRayHit &rayhit) { return rayhit.ray; }
+
+// Spread the low 10 bits of n to every third bit
+static inline uint32_t morton_spread(uint32_t n)
+{
+    n &= 0x3ff;
+    n = (n | (n << 16)) & 0x030000ff;
+    n = (n | (n <<  8)) & 0x0300f00f;
+    n = (n | (n <<  4)) & 0x030c30c3;
+    n = (n | (n <<  2)) & 0x09249249;
+    return n;
+}
+
+// Reorder the first count rays along with their aligned tests so that rays
+// with similar directions and origins are traced together. The rays keep
+// their tests, so results are still accumulated through the test pixel.
+template <typename RAY, typename TEST>
+static void sort_rays(std::vector<RAY> &rays, std::vector<TEST> &tests, int count,
+                      std::vector<std::pair<uint64_t, int>> &keys,
+                      std::vector<RAY> &sorted_rays, std::vector<TEST> &sorted_tests)
+{
+    if (count < 2)
+    {
+        return;
+    }
+
+    // Quantize origins relative to the bounds of the batch
+    Imath::Box3f bounds;
+    for (int i = 0; i < count; i++)
+    {
+        const RTCRay &ray = get_ray(rays[i]);
+        bounds.extendBy(Imath::V3f(ray.org_x, ray.org_y, ray.org_z));
+    }
+    Imath::V3f scale = bounds.size();
+    for (int j = 0; j < 3; j++)
+    {
+        scale[j] = scale[j] > 0 ? 1023.0F / scale[j] : 0.0F;
+    }
+
+    keys.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        const RTCRay &ray = get_ray(rays[i]);
+        uint64_t octant = (ray.dir_x < 0) | ((ray.dir_y < 0) << 1) | ((ray.dir_z < 0) << 2);
+        uint32_t x = (uint32_t)((ray.org_x - bounds.min[0]) * scale[0]);
+        uint32_t y = (uint32_t)((ray.org_y - bounds.min[1]) * scale[1]);
+        uint32_t z = (uint32_t)((ray.org_z - bounds.min[2]) * scale[2]);
+        uint64_t morton = morton_spread(x) | (morton_spread(y) << 1) | (morton_spread(z) << 2);
+        keys[i] = std::make_pair((octant << 30) | morton, i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    sorted_rays.resize(rays.size());
+    sorted_tests.resize(tests.size());
+    for (int i = 0; i < count; i++)
+    {
+        sorted_rays[i] = rays[keys[i].second];
+        sorted_tests[i] = tests[keys[i].second];
+    }
+    rays.swap(sorted_rays);
+    tests.swap(sorted_tests);
+}
+
+void SCENE::trace_primary_packets(const TILE &tile, uint32_t isx_sample, uint32_t isy_sample)
+{
+    const RES &res = m_res;
+    const Imath::M44f &m = m_camera_xform;
+    const Imath::V3f org = m.translation();
+    const int pixel_count = tile.xsize*tile.ysize;
+
+    auto &context = thread_data[tile.tid].context;
+    auto &rayhits = thread_data[tile.tid].rayhits;
+    RTCRayHit8 &packet = thread_data[tile.tid].packet;
+
+    context.flags = RTC_INTERSECT_CONTEXT_FLAG_COHERENT;
+
+    for (int poff0 = 0; poff0 < pixel_count; poff0 += 8)
+    {
+        // Generate the rays lane by lane in SoA layout so that the compiler
+        // can vectorize the sample generation and camera transform
+        alignas(32) int valid[8];
+        for (int l = 0; l < 8; l++)
+        {
+            valid[l] = (poff0 + l < pixel_count) ? -1 : 0;
+
+            // Fill unused lanes with the last pixel
+            int poff = std::min(poff0 + l, pixel_count-1);
+            int px = poff % tile.xsize + tile.xoff;
+            int py = poff / tile.xsize + tile.yoff;
+            float sx, sy;
+            sample_pair(px, py, tile.sidx, isx_sample, isy_sample, PIXEL_SAMPLE, sx, sy);
+            float dx = (px + sx) / (float)res.xres;
+            float dz = (py + sy) / (float)res.yres;
+            dx = ( dx - 0.5F);
+            dz = (-dz + 0.5F);
+
+            // Equivalent to multDirMatrix with a y component of 1
+            packet.ray.dir_x[l] = dx*m[0][0] + m[1][0] + dz*m[2][0];
+            packet.ray.dir_y[l] = dx*m[0][1] + m[1][1] + dz*m[2][1];
+            packet.ray.dir_z[l] = dx*m[0][2] + m[1][2] + dz*m[2][2];
+            packet.ray.org_x[l] = org[0];
+            packet.ray.org_y[l] = org[1];
+            packet.ray.org_z[l] = org[2];
+            packet.ray.tnear[l] = 0;
+            packet.ray.tfar[l] = std::numeric_limits<float>::infinity();
+            packet.ray.time[l] = 0;
+            packet.ray.mask[l] = -1;
+            packet.ray.id[l] = 0;
+            packet.ray.flags[l] = 0;
+            packet.hit.geomID[l] = RTC_INVALID_GEOMETRY_ID;
+            packet.hit.instID[0][l] = RTC_INVALID_GEOMETRY_ID;
+        }
+
+        rtcIntersect8(valid, scene, &context, &packet);
+
+        // Scatter to the single ray layout used for shading
+        for (int l = 0; l < 8 && poff0 + l < pixel_count; l++)
+        {
+            RTCRayHit &rayhit = rayhits[poff0 + l];
+            rayhit.ray.org_x = packet.ray.org_x[l];
+            rayhit.ray.org_y = packet.ray.org_y[l];
+            rayhit.ray.org_z = packet.ray.org_z[l];
+            rayhit.ray.tnear = packet.ray.tnear[l];
+            rayhit.ray.dir_x = packet.ray.dir_x[l];
+            rayhit.ray.dir_y = packet.ray.dir_y[l];
+            rayhit.ray.dir_z = packet.ray.dir_z[l];
+            rayhit.ray.time = packet.ray.time[l];
+            rayhit.ray.tfar = packet.ray.tfar[l];
+            rayhit.ray.mask = packet.ray.mask[l];
+            rayhit.ray.id = packet.ray.id[l];
+            rayhit.ray.flags = packet.ray.flags[l];
+            rayhit.hit.Ng_x = packet.hit.Ng_x[l];
+            rayhit.hit.Ng_y = packet.hit.Ng_y[l];
+            rayhit.hit.Ng_z = packet.hit.Ng_z[l];
+            rayhit.hit.u = packet.hit.u[l];
+            rayhit.hit.v = packet.hit.v[l];
+            rayhit.hit.primID = packet.hit.primID[l];
+            rayhit.hit.geomID = packet.hit.geomID[l];
+            for (int i = 0; i < RTC_MAX_INSTANCE_LEVEL_COUNT; i++)
+            {
+                rayhit.hit.instID[i] = packet.hit.instID[i][l];
+            }
+        }
+    }
+}
+
+bool SCENE::render_tile(TILE &tile)
 {
+    const RES &res = m_res;
+    const SUN_SKY_LIGHT &light = *m_light;
+    const Imath::M44f &camera_xform = m_camera_xform;
+    const SHADING_MODE shading_mode = m_shading_mode;
+    const int reflect_limit = m_reflect_limit;
+
     auto &context = thread_data[tile.tid].context;
     auto &rayhits = thread_data[tile.tid].rayhits;
     auto &occrays = thread_data[tile.tid].occrays;
     auto &shading_test = thread_data[tile.tid].shading_test;
     auto &shadow_test = thread_data[tile.tid].shadow_test;
+    auto &ray_counts = thread_data[tile.tid].ray_counts;
+    auto &tile_colors = thread_data[tile.tid].tile_colors;
+
+    tile_colors.assign(tile.xsize*tile.ysize, Imath::C3f(0));
+
+    // First hit albedo and normals for the denoiser
+    const bool aovs = !m_albedo.empty() && !tile.preview;
+    const bool first_hits = !m_hit_depths.empty() && !tile.preview && tile.sidx == 0;
+    auto &tile_albedo = thread_data[tile.tid].tile_albedo;
+    auto &tile_normals = thread_data[tile.tid].tile_normals;
+    if (aovs)
+    {
+        tile_albedo.assign(tile.xsize*tile.ysize, Imath::C3f(0));
+        tile_normals.assign(tile.xsize*tile.ysize, Imath::V3f(0));
+    }
+
+    const auto start_time = std::chrono::steady_clock::now();
+    uint64_t start_counts[RAY_TYPE_COUNT];
+    std::copy(ray_counts, ray_counts + RAY_TYPE_COUNT, start_counts);
 
-    // Primary rays
+    // The sample pattern index is shared by all pixels in the tile
+    const uint32_t isx_sample = vandercorput(tile.sidx);
+    const uint32_t isy_sample = sobol2(tile.sidx);
+
+    // Primary rays. The preview traces the center pixel of each square of
+    // preview_scale pixels.
+    const int step = tile.preview ? res.preview_scale : 1;
     shading_test.clear();
-    for (int y = 0; y < tile.ysize; y++)
+    for (int y = 0; y < tile.ysize; y += step)
     {
-        for (int x = 0; x < tile.xsize; x++)
+        for (int x = 0; x < tile.xsize; x += step)
+        {
+            SHADING_TEST test;
+            test.clr = Imath::C3f(1,1,1);
+            test.px = std::min(x + step/2, tile.xsize-1) + tile.xoff;
+            test.py = std::min(y + step/2, tile.ysize-1) + tile.yoff;
+            shading_test.push_back(test);
+        }
+    }
+
+    ray_counts[PRIMARY_RAY] += shading_test.size();
+
+    if (m_ray_packets && !tile.preview)
+    {
+        trace_primary_packets(tile, isx_sample, isy_sample);
+    }
+    else
+    {
+        const Imath::V3f org = camera_xform.translation();
+        for (int poff = 0; poff < shading_test.size(); poff++)
         {
-            int poff = y*tile.xsize+x;
-            int px = x + tile.xoff;
-            int py = y + tile.yoff;
-            int ioff = py * res.xres + px;
-            auto [h_ioffx,h_ioffy] = p_hash_eval(px, py);
-            uint32_t isx = h_ioffx ^ vandercorput(tile.sidx);
-            uint32_t isy = h_ioffy ^ sobol2(tile.sidx);
-            float sx = sample_to_float(isx, seeds[0]);
-            float sy = sample_to_float(isy, seeds[1]);
+            int px = shading_test[poff].px;
+            int py = shading_test[poff].py;
+            float sx, sy;
+            sample_pair(px, py, tile.sidx, isx_sample, isy_sample, PIXEL_SAMPLE, sx, sy);
             float dx = (px + sx) / (float)res.xres;
             float dz = (py + sy) / (float)res.yres;
             dx = ( dx - 0.5F);
             dz = (-dz + 0.5F);
             Imath::V3f dir;
             camera_xform.multDirMatrix(Imath::V3f(dx, 1, dz), dir);
-            RTCRayHit &rayhit = rayhits[poff];
-            init_rayhit(rayhit, camera_xform.translation(), dir);
-            SHADING_TEST test;
-            test.clr = Imath::C3f(1,1,1);
-            test.px = px;
-            test.py = py;
-            shading_test.push_back(test);
+            init_rayhit(rayhits[poff], org, dir);
         }
     }
 
-    // Loop over ray levels
+    // Loop over ray levels, giving up between ray stages if cancelled
     for (int reflect_level = 0; reflect_level < reflect_limit && !shading_test.empty(); ++reflect_level)
     {
-        rtcIntersect1M(scene, &context, rayhits.data(), shading_test.size(), sizeof(RTCRayHit));
+        if (cancelled())
+        {
+            return false;
+        }
+
+        // Primary rays are coherent, and may already have been traced in
+        // packets
+        context.flags = reflect_level == 0 ? RTC_INTERSECT_CONTEXT_FLAG_COHERENT
+                                           : RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+        if (reflect_level > 0 && m_ray_sorting)
+        {
+            auto &td = thread_data[tile.tid];
+            sort_rays(rayhits, shading_test, shading_test.size(),
+                      td.sort_keys, td.sorted_rayhits, td.sorted_shading_test);
+        }
+        if (reflect_level > 0)
+        {
+            ray_counts[REFLECTION_RAY] += shading_test.size();
+        }
+        if (reflect_level > 0 || !m_ray_packets)
+        {
+            rtcIntersect1M(scene, &context, rayhits.data(), shading_test.size(), sizeof(RTCRayHit));
+        }
 
         int shading_count = 0;
         shadow_test.clear();
@@ -394,22 +2525,40 @@ void SCENE::render_tile(const TILE &tile, const RES &res, const SUN_SKY_LIGHT &l
         {
             int px = shading_test[poff].px;
             int py = shading_test[poff].py;
-            int ioff = py * res.xres + px;
+            int toff = (py - tile.yoff) * tile.xsize + (px - tile.xoff);
             const RTCRayHit &rayhit = rayhits[poff];
             Imath::V3f dir(rayhit.ray.dir_x, rayhit.ray.dir_y, rayhit.ray.dir_z);
-            if (shading_mode != PHYSICAL)
+
+            // Remember the first hit of the first sample for reprojection
+            if (first_hits && reflect_level == 0)
+            {
+                size_t ioff = (size_t)py*res.xres + px;
+                if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID)
+                {
+                    Imath::V3f org(rayhit.ray.org_x, rayhit.ray.org_y, rayhit.ray.org_z);
+                    m_hit_positions[ioff] = org + dir*rayhit.ray.tfar;
+                    m_hit_depths[ioff] = rayhit.ray.tfar * dir.length();
+                }
+                else
+                {
+                    m_hit_positions[ioff] = dir.normalized();
+                    m_hit_depths[ioff] = std::numeric_limits<float>::infinity();
+                }
+            }
+
+            if (shading_mode == GEOM_ID || shading_mode == PRIM_ID)
             {
                 if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID)
                 {
                     if (shading_mode == GEOM_ID)
                     {
                         auto clr = i_hash_eval(rayhit.hit.geomID);
-                        pixelcolors[ioff] += clr;
+                        tile_colors[toff] += clr;
                     }
                     else if (shading_mode == PRIM_ID)
                     {
                         auto clr = i_hash_eval(rayhit.hit.primID);
-                        pixelcolors[ioff] += clr;
+                        tile_colors[toff] += clr;
                     }
                 }
             }
@@ -419,11 +2568,19 @@ void SCENE::render_tile(const TILE &tile, const RES &res, const SUN_SKY_LIGHT &l
                 P += dir*rayhit.ray.tfar;
 
                 BRDF brdf;
+                const INSTANCE_DATA *inst = nullptr;
                 if (rayhit.hit.instID[0] != RTC_INVALID_GEOMETRY_ID)
                 {
-                    const float inst_color_variance = 0.2F;
+                    int idx = m_instance_offsets[rayhit.hit.instID[0]];
+#if RTC_MAX_INSTANCE_LEVEL_COUNT > 1
+                    if (rayhit.hit.instID[1] != RTC_INVALID_GEOMETRY_ID)
+                    {
+                        idx += rayhit.hit.instID[1];
+                    }
+#endif
+                    inst = &m_instances[idx];
                     brdf = shaders[inst_shader_index[rayhit.hit.geomID]];
-                    brdf.modulate_color(i_hash_eval(rayhit.hit.instID[0]) * inst_color_variance);
+                    brdf.modulate_color(inst->color_offset);
                 }
                 else
                 {
@@ -433,7 +2590,32 @@ void SCENE::render_tile(const TILE &tile, const RES &res, const SUN_SKY_LIGHT &l
                 Imath::V3f Ng(rayhit.hit.Ng_x, rayhit.hit.Ng_y, rayhit.hit.Ng_z);
                 Imath::V3f N;
 
-                if (brdf.is_smooth_N())
+                const SMOOTH_NORMALS *smooth = nullptr;
+                if (!inst && rayhit.hit.geomID < m_smooth_normals.size() &&
+                    m_smooth_normals[rayhit.hit.geomID].normals)
+                {
+                    smooth = &m_smooth_normals[rayhit.hit.geomID];
+                }
+
+                if (brdf.is_smooth_N() && smooth)
+                {
+                    // Interpolate as Embree does, over the triangle of the
+                    // quad (v0, v1, v3) or (v2, v3, v1) containing the hit
+                    const unsigned *quad = smooth->indices + 4*rayhit.hit.primID;
+                    float u = rayhit.hit.u;
+                    float v = rayhit.hit.v;
+                    bool left = u + v <= 1.0F;
+                    const Imath::V3f &n0 = smooth->normals[quad[left ? 0 : 2]];
+                    const Imath::V3f &n1 = smooth->normals[quad[left ? 1 : 3]];
+                    const Imath::V3f &n2 = smooth->normals[quad[left ? 3 : 1]];
+                    if (!left)
+                    {
+                        u = 1.0F - u;
+                        v = 1.0F - v;
+                    }
+                    N = (1.0F - u - v)*n0 + u*n1 + v*n2;
+                }
+                else if (brdf.is_smooth_N())
                 {
                     RTCInterpolateArguments interp;
                     memset(&interp, 0, sizeof(RTCInterpolateArguments));
@@ -451,23 +2633,17 @@ void SCENE::render_tile(const TILE &tile, const RES &res, const SUN_SKY_LIGHT &l
                     N = Ng;
                 }
 
-                if (rayhit.hit.instID[0] != RTC_INVALID_GEOMETRY_ID)
+                if (inst)
                 {
-                    auto geo = rtcGetGeometry(scene, rayhit.hit.instID[0]);
-                    Imath::M44f xform;
-                    rtcGetGeometryTransform(geo, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &xform);
                     if (N == Ng)
                     {
-                        auto tmp = Ng;
-                        xform.multDirMatrix(tmp, Ng);
+                        Ng = Ng * inst->normal_xform;
                         N = Ng;
                     }
                     else
                     {
-                        auto tmpNg = Ng;
-                        xform.multDirMatrix(tmpNg, Ng);
-                        auto tmpN = N;
-                        xform.multDirMatrix(tmpN, N);
+                        Ng = Ng * inst->normal_xform;
+                        N = N * inst->normal_xform;
                     }
                 }
 
@@ -481,19 +2657,23 @@ void SCENE::render_tile(const TILE &tile, const RES &res, const SUN_SKY_LIGHT &l
                 N.normalize();
                 dir.normalize();
 
-                const float bias = 0.001F;
+                if (aovs && reflect_level == 0)
+                {
+                    const Imath::C3f &clr = brdf.color();
+                    tile_albedo[toff] += Imath::C3f(std::min(clr[0], 1.0F), std::min(clr[1], 1.0F), std::min(clr[2], 1.0F));
+                    tile_normals[toff] += N;
+                }
 
-                auto [h_ioffx,h_ioffy] = p_hash_eval(px, py);
+                const float bias = 0.001F;
 
                 SHADOW_TEST test;
-                test.ioff = ioff;
+                test.toff = toff;
 
-                uint32_t isx = h_ioffx ^ vandercorput(tile.sidx);
-                uint32_t isy = h_ioffy ^ sobol2(tile.sidx);
-                float bsx = sample_to_float(isx, seeds[2]);
-                float bsy = sample_to_float(isy, seeds[3]);
-                float lsx = sample_to_float(isx, seeds[4]);
-                float lsy = sample_to_float(isy, seeds[5]);
+                // The pair sampler reuses its dimensions at every level
+                const int level_dim = m_sampler == SOBOL_SAMPLER ? reflect_level*LEVEL_SAMPLES : 0;
+                float bsx, bsy, lsx, lsy;
+                sample_pair(px, py, tile.sidx, isx_sample, isy_sample, BRDF_SAMPLE + level_dim, bsx, bsy);
+                sample_pair(px, py, tile.sidx, isx_sample, isy_sample, LIGHT_SAMPLE + level_dim, lsx, lsy);
 
                 Imath::C3f b_clr;
                 Imath::V3f b_dir;
@@ -552,10 +2732,30 @@ void SCENE::render_tile(const TILE &tile, const RES &res, const SUN_SKY_LIGHT &l
                 float pdf;
                 dir.normalize();
                 light.evaluate(clr, pdf, dir);
-                pixelcolors[ioff] += clr * shading_test[poff].clr;
+                tile_colors[toff] += clr * shading_test[poff].clr;
+
+                // The albedo of the sky is its clamped radiance
+                if (aovs && reflect_level == 0)
+                {
+                    tile_albedo[toff] += Imath::C3f(std::min(clr[0], 1.0F), std::min(clr[1], 1.0F), std::min(clr[2], 1.0F));
+                }
             }
         }
 
+        if (m_ray_sorting)
+        {
+            auto &td = thread_data[tile.tid];
+            sort_rays(occrays, shadow_test, shadow_test.size(),
+                      td.sort_keys, td.sorted_occrays, td.sorted_shadow_test);
+        }
+
+        if (cancelled())
+        {
+            return false;
+        }
+
+        ray_counts[SHADOW_RAY] += shadow_test.size();
+        context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
         rtcOccluded1M(scene, &context, occrays.data(), shadow_test.size(), sizeof(RTCRay));
 
         // Add unshadowed lighting
@@ -564,28 +2764,157 @@ void SCENE::render_tile(const TILE &tile, const RES &res, const SUN_SKY_LIGHT &l
             const RTCRay &ray = occrays[i];
             if (ray.tfar >= 0)
             {
-                int ioff = shadow_test[i].ioff;
-                pixelcolors[ioff] += shadow_test[i].clr;
+                tile_colors[shadow_test[i].toff] += shadow_test[i].clr;
             }
         }
 
         shading_test.resize(shading_count);
     }
 
-    // Finalize the tile
+    tile.time = std::chrono::duration<float>(std::chrono::steady_clock::now() - start_time).count();
+    for (int i = 0; i < RAY_TYPE_COUNT; i++)
+    {
+        tile.rays[i] = (int)(ray_counts[i] - start_counts[i]);
+    }
+
+    if (shading_mode == TIME_HEATMAP || shading_mode == RAYS_HEATMAP)
+    {
+        tile_colors.assign(tile.xsize*tile.ysize, tile_heatmap(tile));
+    }
+
+    accumulate_tile(tile);
+    return true;
+}
+
+void SCENE::accumulate_preview(const TILE &tile)
+{
+    const RES &res = m_res;
+    const int scale = res.preview_scale;
+    const auto &tile_colors = thread_data[tile.tid].tile_colors;
+    if (!m_shared_data) return;
+
+    uint32_t *preview = (uint32_t *)((char *)m_shared_data + res.preview_offset());
+    for (int y = 0; y < tile.ysize; y += scale)
+    {
+        int ioff = (y + tile.yoff) / scale * res.preview_xres() + tile.xoff / scale;
+        int ty = std::min(y + scale/2, tile.ysize-1);
+        for (int x = 0; x < tile.xsize; x += scale)
+        {
+            int tx = std::min(x + scale/2, tile.xsize-1);
+            auto clr = tile_colors[ty*tile.xsize + tx];
+            clr[0] = std::min(powf(std::max(clr[0], 0.0F), res.igamma), 1.0F);
+            clr[1] = std::min(powf(std::max(clr[1], 0.0F), res.igamma), 1.0F);
+            clr[2] = std::min(powf(std::max(clr[2], 0.0F), res.igamma), 1.0F);
+            preview[ioff + x / scale] = Imath::rgb2packed(clr);
+        }
+    }
+}
+
+Imath::C3f SCENE::tile_heatmap(const TILE &tile) const
+{
+    // Map the cost per pixel on a log scale, from blue for one primary ray
+    // or 100ns to red for the full reflection limit or 25.6us
+    float pixels = tile.xsize*tile.ysize;
+    float level;
+    if (m_shading_mode == TIME_HEATMAP)
+    {
+        level = log2f(std::max(tile.time * 1e9F / pixels, 100.0F) / 100.0F) / 8.0F;
+    }
+    else
+    {
+        int rays = 0;
+        for (int i = 0; i < RAY_TYPE_COUNT; i++)
+        {
+            rays += tile.rays[i];
+        }
+        level = log2f(std::max(rays / pixels, 1.0F)) / log2f(2.0F*(m_reflect_limit+1));
+    }
+    level = std::min(level, 1.0F);
+    return Imath::hsv2rgb(Imath::V3f((1.0F - level) * 2.0F/3.0F, 1.0F, 1.0F));
+}
+
+void SCENE::accumulate_tile(TILE &tile)
+{
+    const RES &res = m_res;
+    const float igamma = res.igamma;
+    const auto &tile_colors = thread_data[tile.tid].tile_colors;
+    const int nsamples = tile.sidx+1;
+
+    if (tile.preview)
+    {
+        accumulate_preview(tile);
+        return;
+    }
+
+    for (int y = 0; y < tile.ysize; y++)
+    {
+        int ioff = (y + tile.yoff) * res.xres + tile.xoff;
+        for (int x = 0; x < tile.xsize; x++)
+        {
+            // The first sample replaces any reprojected estimate
+            Imath::C3f color = tile_colors[y*tile.xsize + x];
+            if (nsamples > 1)
+            {
+                color += pixelcolors[ioff + x];
+            }
+            publish_pixel(pixelcolors[ioff + x], samplecounts[ioff + x], color, (float)nsamples);
+        }
+    }
+
+    if (!m_albedo.empty())
+    {
+        const auto &tile_albedo = thread_data[tile.tid].tile_albedo;
+        const auto &tile_normals = thread_data[tile.tid].tile_normals;
+        for (int y = 0; y < tile.ysize; y++)
+        {
+            int ioff = (y + tile.yoff) * res.xres + tile.xoff;
+            for (int x = 0; x < tile.xsize; x++)
+            {
+                m_albedo[ioff + x] += tile_albedo[y*tile.xsize + x];
+                m_normals[ioff + x] += tile_normals[y*tile.xsize + x];
+            }
+        }
+    }
+
+    // Estimate the error from the difference between the full image and
+    // the odd samples, which have equal weight after an even sample count
+    tile.error = std::numeric_limits<float>::infinity();
+    if (!m_half_buffer.empty() && (tile.sidx & 1))
+    {
+        float error = 0;
+        for (int y = 0; y < tile.ysize; y++)
+        {
+            int ioff = (y + tile.yoff) * res.xres + tile.xoff;
+            for (int x = 0; x < tile.xsize; x++)
+            {
+                Imath::C3f &half = m_half_buffer[ioff + x];
+                half += tile_colors[y*tile.xsize + x];
+
+                Imath::C3f full = pixelcolors[ioff + x] / nsamples;
+                Imath::C3f diff = full - half / (nsamples/2);
+                float sum = full[0] + full[1] + full[2];
+                error += (fabsf(diff[0]) + fabsf(diff[1]) + fabsf(diff[2])) / sqrtf(std::max(sum, 1e-4F));
+            }
+        }
+        tile.error = error / (tile.xsize*tile.ysize);
+    }
+
+    // Finalize the tile for display. The GUI normalizes and gamma corrects
+    // the float buffer itself.
+    if (!m_shared_data || res.float_buffer) return;
+
     for (int y = 0; y < tile.ysize; y++)
     {
         for (int x = 0; x < tile.xsize; x++)
         {
-            int poff = y*tile.xsize+x;
             int ioff = (y + tile.yoff) * res.xres + x + tile.xoff;
-            auto clr = pixelcolors[ioff] / (tile.sidx+1);
+            auto clr = pixelcolors[ioff] / nsamples;
             // Gamma correction
             clr[0] = std::min(powf(std::max(clr[0], 0.0F), igamma), 1.0F);
             clr[1] = std::min(powf(std::max(clr[1], 0.0F), igamma), 1.0F);
             clr[2] = std::min(powf(std::max(clr[2], 0.0F), igamma), 1.0F);
             uint32_t val = Imath::rgb2packed(clr);
-            m_shared_data[res.tres*res.tres*tile.tid + poff] = val;
+            m_shared_data[ioff] = val;
         }
     }
 }
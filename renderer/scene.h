@@ -8,12 +8,20 @@
 #define SCENE_H
 
 #include <iostream>
+#include <memory>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <atomic>
 #include <nlohmann/json.hpp>
 #include <embree3/rtcore.h>
+#include <tbb/task_arena.h>
 #include "ImathColor.h"
 #include "ImathColorAlgo.h"
+#include "ImathMatrix.h"
 #include "tile.h"
 #include "shading.h"
+#include "tree.h"
 
 class SCENE
 {
@@ -22,35 +30,205 @@ public:
     ~SCENE();
 
     void load(std::istream &is);
+    void load(const nlohmann::json &scene);
     void update(std::istream &is);
+    void update(const nlohmann::json &json_updates);
+    void update(const std::vector<PARAM_VALUE> &values);
+
+    // Assign parameter ids in the order of the --dump_ui parameters and
+    // tabulate the state that each one invalidates
+    void set_parameters(const nlohmann::json &json_ui);
+
+    // Interactive rendering driven by the GUI tile protocol
     int render();
 
+    // Headless rendering of all tiles and samples to an image file.
+    // Optionally reports build timings and ray counts in stats.
+    int render_batch(const std::string &filename, nlohmann::json *stats = nullptr);
+
+    // Headless rendering of the frames of an animation sequence to images
+    // named by the pattern, which may have a printf style frame number.
+    // The sequence has a list of keys, each with a frame and the scene
+    // parameters set at that frame, and optionally a frame count.
+    // frame_stats is called with the stats of each frame.
+    int render_sequence(const std::string &pattern, const nlohmann::json &sequence,
+                        const std::function<void(int, const nlohmann::json &)> &frame_stats);
+
+    // Parameters of a frame of the sequence interpolated from its keys
+    static nlohmann::json sequence_frame(const nlohmann::json &sequence, int frame);
+
+    // Batch rendering on remote workers that connect on port, handing out
+    // chunk_samples samples of a tile at a time
+    int render_coordinator(const std::string &filename, int port, int chunk_samples);
+
+    // Render tiles for the coordinator at host:port. Uses all cores if
+    // nthreads is 0, and the scene memory budget if memory_budget is 0.
+    int render_worker(const std::string &address, int nthreads, float memory_budget = 0);
+
 private:
+    // Geometry is tracked separately for each subsystem so that parameter
+    // changes only rebuild the affected geometry
+    enum GEOMETRY_TYPE {
+        GROUND_GEOMETRY,
+        WATER_GEOMETRY,
+        VEGETATION_GEOMETRY,
+        FOREST_LOD_GEOMETRY, // Forest instances, reattached at new levels of detail
+        GEOMETRY_TYPE_COUNT
+    };
+
+    // Creates the scene or rebuilds the dirty geometry
     void create_geometry();
+
+    // Reduce the detail of the geometry parameters until the estimated
+    // Embree memory fits memory_budget, returning the estimate of each
+    // subsystem in bytes. Only the detail of the rebuild mask of
+    // GEOMETRY_TYPEs is reduced, the rest keeping their last estimate.
+    nlohmann::json fit_memory_budget(nlohmann::json &parameters, unsigned rebuild) const;
     void clear_geometry();
 
     void fill_sample_caches();
 
+    enum SAMPLER {
+        PAIR_SAMPLER, // One scrambled 2D sequence shared by all dimensions
+        SOBOL_SAMPLER // Owen scrambled Sobol sequence with a dimension each
+    };
+
+    // Sample dimensions, with the BRDF and light dimensions repeated for
+    // each reflection level
+    enum SAMPLE_DIMENSION {
+        PIXEL_SAMPLE = 0,
+        BRDF_SAMPLE = 2,
+        LIGHT_SAMPLE = 4,
+        LEVEL_SAMPLES = 4
+    };
+
+    // Samples of the dimensions dim and dim+1 for a pixel. The pair
+    // sampler shares the tile sample pattern isx, isy between all pairs.
+    void sample_pair(int px, int py, uint32_t sidx, uint32_t isx, uint32_t isy,
+                     int dim, float &sx, float &sy) const;
+
     enum SHADING_MODE {
         PHYSICAL,
         GEOM_ID,
-        PRIM_ID
+        PRIM_ID,
+        TIME_HEATMAP, // Physical render replaced by its per-tile cost
+        RAYS_HEATMAP
     };
 
-    void render_tile(const TILE &tile,
-                     const RES &res,
-                     const SUN_SKY_LIGHT &light,
-                     const Imath::M44f &camera_xform,
-                     float igamma,
-                     SHADING_MODE shading_mode,
-                     int reflect_limit);
+    RES get_res() const;
+
+    // Parameters that only move the camera
+    static const std::vector<std::string> &camera_parameters();
+
+    // Camera to world transform, with the image plane at unit distance
+    Imath::M44f camera_transform(const RES &res) const;
+
+    // Project the first hits of the current image into the view of the
+    // given camera. Pixels with no estimate have a depth of 0.
+    void reproject_image(const Imath::M44f &camera_xform,
+                         std::vector<Imath::C3f> &image,
+                         std::vector<float> &depths) const;
+
+    // Create a task arena for the render threads of each NUMA node.
+    // Returns true if the arenas changed.
+    bool setup_arenas(int nthreads);
+
+    // Run the function for each arena index in its arena, concurrently
+    void run_arenas(const std::function<void(int)> &fn);
+
+    // Each arena owns a band of image rows, first touching their pixels
+    // and queueing their tiles. Threads take the best tile of any band,
+    // preferring their own on ties.
+    int arena_of_row(int y, int yres) const
+    {
+        return (int64_t)y * m_arenas.size() / yres;
+    }
+
+    // Allocate or clear the accumulated image and sample counts
+    void setup_image(const RES &res);
+
+    // Prepare shaders, geometry, camera and per-thread data for rendering
+    // tiles at the given resolution
+    void setup_render(const RES &res);
+
+    // Render all tiles and samples from an in-process work queue. The
+    // callback is run after each tile sample and returns false to stop
+    // rendering. Returns the number of tile samples rendered.
+    int render_tiles(const std::function<bool(const TILE &)> &tile_complete);
+
+    // Returns false if the render was cancelled before the sample was
+    // complete, in which case it is not accumulated
+    bool render_tile(TILE &tile);
+
+    bool cancelled() const
+    {
+        return m_cancel && m_cancel->load(std::memory_order_relaxed);
+    }
+
+    // Add the tile sample to the image and update the tile error estimate
+    void accumulate_tile(TILE &tile);
+
+    // Build the shading data of the forest trees from their transforms
+    void create_instance_table(const FOREST_INSTANCES &instances);
+
+    // Write a preview tile to the shared preview image
+    void accumulate_preview(const TILE &tile);
+
+    // Cost of a rendered tile sample as a heatmap colour
+    Imath::C3f tile_heatmap(const TILE &tile) const;
+
+    // Generate and trace the primary rays of a tile in packets of 8,
+    // leaving the hits in rayhits
+    void trace_primary_packets(const TILE &tile, uint32_t isx, uint32_t isy);
+
+    // Render all tiles and samples of the current scene without a display.
+    // Returns false if the geometry could not be built.
+    bool render_frame(nlohmann::json *stats);
+
+    // Normalize the image and AOVs by the sample counts, denoising the
+    // image if enabled. The AOVs are empty unless denoising.
+    void resolve_image(std::vector<Imath::C3f> &image,
+                       std::vector<Imath::C3f> &albedo,
+                       std::vector<Imath::V3f> &normals) const;
+
+    bool save_image(const std::string &filename) const;
+    static bool write_image(const std::string &filename, int xres, int yres,
+                            const std::vector<Imath::C3f> &image,
+                            const std::vector<Imath::C3f> &albedo,
+                            const std::vector<Imath::V3f> &normals);
+
+    // Replace the shared display image with the denoised image
+    void display_denoised();
 
 private:
     nlohmann::json json_scene;
 
+    // Render settings, initialized by setup_render()
+    // {
+    RES m_res;
+    std::unique_ptr<SUN_SKY_LIGHT> m_light;
+    Imath::M44f m_camera_xform;
+    SHADING_MODE m_shading_mode = PHYSICAL;
+    int m_reflect_limit = 1;
+    bool m_ray_packets = false;
+    bool m_ray_sorting = false;
+    float m_adaptive_threshold = 0;
+    int m_adaptive_min_samples = 0;
+    // }
+
     size_t   m_shm_size = 0;
     uint    *m_shared_data = nullptr;
 
+    // Set by the GUI in shared memory to abandon the current render
+    std::atomic<uint32_t> *m_cancel = nullptr;
+
+    // Image pixel whose tiles are rendered first, set by FOCUS requests
+    // from the GUI and kept across renders
+    std::mutex m_focus_mutex;
+    int m_focus_x = -1;
+    int m_focus_y = -1;
+    std::atomic<bool> m_focus_changed{false};
+
     RTCDevice device = nullptr;
 
     // Geometry
@@ -58,12 +236,104 @@ private:
     std::vector<int> shader_index; // Indexed by geometry ID
     std::vector<int> inst_shader_index; // Indexed by instance geometry ID
 
+    // Attached terrain geometry IDs, indexed by GEOMETRY_TYPE. Vegetation
+    // is rebuilt with a new scene so its IDs are not tracked.
+    unsigned int m_geometry_ids[GEOMETRY_TYPE_COUNT] = {
+        RTC_INVALID_GEOMETRY_ID, RTC_INVALID_GEOMETRY_ID,
+        RTC_INVALID_GEOMETRY_ID, RTC_INVALID_GEOMETRY_ID};
+    unsigned m_dirty_geometry = ~0U;
+    bool m_scene_committed = false; // A cancel may leave the scene uncommitted
+
+    // Build times in seconds of the subsystems rebuilt by the last
+    // create_geometry(), and the resulting Embree memory
+    nlohmann::json m_build_stats;
+
+    // Estimated Embree memory of each subsystem as last built
+    nlohmann::json m_memory_estimate = nlohmann::json::object();
+
+    // Camera dependencies of the grid terrain as last built, or null
+    nlohmann::json m_terrain_camera;
+
+    // Render state rebuilt by setup_render() when a parameter changes
+    enum RENDER_STATE {
+        SHADER_STATE  = 1 << 0,
+        LIGHT_STATE   = 1 << 1,
+        CAMERA_STATE  = 1 << 2
+    };
+    unsigned m_dirty_state = ~0U;
+
+    enum PARAMETER_TYPE {
+        INT_PARAMETER,
+        FLOAT_PARAMETER,
+        BOOL_PARAMETER,
+        STRING_PARAMETER
+    };
+    struct UI_PARAMETER
+    {
+        std::string     name;
+        PARAMETER_TYPE  type;
+        int             vector_size;
+        unsigned        geometry = 0; // Bit mask of the GEOMETRY_TYPEs rebuilt
+        unsigned        lod_geometry = 0; // GEOMETRY_TYPEs rebuilt if their detail follows the camera
+        unsigned        state = 0; // Bit mask of the RENDER_STATEs rebuilt
+    };
+    std::vector<UI_PARAMETER> m_parameters; // Indexed by parameter id
+    std::map<std::string, int> m_parameter_ids;
+
+    // Mark the state depending on the updated parameter ids, where -1 is a
+    // parameter outside the UI
+    void invalidate(const std::vector<int> &ids);
+
+    // Shading data of the forest trees, indexed by the offset of the top
+    // level instance ID plus the tree instance ID in clustered forest cells
+    struct INSTANCE_DATA
+    {
+        Imath::M33f normal_xform;
+        Imath::C3f color_offset;
+    };
+    std::vector<INSTANCE_DATA> m_instances;
+
+    // Forest trees, kept while their instances are reattached for a new
+    // camera
+    FOREST_TREES m_forest_trees;
+    std::vector<int> m_instance_offsets; // Indexed by top level geometry ID
+
+    // Buffers of quad geometry for interpolating smooth normals, indexed by
+    // geometry ID
+    struct SMOOTH_NORMALS
+    {
+        const unsigned *indices = nullptr;
+        const Imath::V3f *normals = nullptr;
+    };
+    std::vector<SMOOTH_NORMALS> m_smooth_normals;
+
     // These vectors are aligned
     std::vector<BRDF> shaders;
     std::vector<std::string> shader_names;
 
-    // Rendered image
-    std::vector<Imath::C3f> pixelcolors;
+    // Rendered image and per-pixel sample counts, either owned or in
+    // shared memory
+    Imath::C3f *pixelcolors = nullptr;
+    float *samplecounts = nullptr;
+    std::unique_ptr<Imath::C3f[]> pixelcolors_buffer; // Uninitialized until setup_image()
+    std::unique_ptr<float[]> samplecounts_buffer;
+    size_t m_image_pixels = 0;
+
+    // Sum of the odd samples for adaptive sampling error estimates
+    std::vector<Imath::C3f> m_half_buffer;
+
+    // Accumulated first hit albedo and normals, allocated when denoising
+    bool m_denoise = false;
+    std::vector<Imath::C3f> m_albedo;
+    std::vector<Imath::V3f> m_normals;
+
+    // First hit of the first sample of each pixel when reprojection is
+    // enabled. The depth is 0 before the pixel is rendered and infinite
+    // for sky pixels, which store the ray direction.
+    std::vector<Imath::V3f> m_hit_positions;
+    std::vector<float> m_hit_depths;
+    bool m_camera_update = false; // The last update only moved the camera
+    bool m_reprojected = false; // The image was seeded by reprojection
 
     // Cached per-thread data
     // {
@@ -76,17 +346,51 @@ private:
     struct SHADOW_TEST
     {
         Imath::C3f  clr;
-        int         ioff;
+        int         toff; // Pixel offset in the tile
+    };
+    enum RAY_TYPE {
+        PRIMARY_RAY,
+        REFLECTION_RAY,
+        SHADOW_RAY,
+        RAY_TYPE_COUNT
     };
-    struct THREAD_DATA
+    static_assert(RAY_TYPE_COUNT == sizeof(TILE::rays)/sizeof(int), "TILE::rays is indexed by RAY_TYPE");
+    // Aligned so that the ray counts of neighbouring threads don't share
+    // a cache line. The buffers are allocated by the render thread itself
+    // so that they are on its NUMA node.
+    struct alignas(64) THREAD_DATA
     {
         std::vector<RTCRayHit> rayhits;
         std::vector<RTCRay> occrays;
         std::vector<SHADING_TEST> shading_test;
         std::vector<SHADOW_TEST> shadow_test;
+        std::vector<Imath::C3f> tile_colors; // Radiance of the tile sample
+        std::vector<Imath::C3f> tile_albedo; // First hit albedo of the tile sample
+        std::vector<Imath::V3f> tile_normals; // First hit normals of the tile sample
+        RTCRayHit8 packet;
         RTCIntersectContext context;
+
+        // Rays traced since setup_render(), indexed by RAY_TYPE
+        uint64_t ray_counts[RAY_TYPE_COUNT] = {0};
+
+        // Scratch space for sorting secondary rays
+        std::vector<std::pair<uint64_t, int>> sort_keys;
+        std::vector<RTCRayHit> sorted_rayhits;
+        std::vector<RTCRay> sorted_occrays;
+        std::vector<SHADING_TEST> sorted_shading_test;
+        std::vector<SHADOW_TEST> sorted_shadow_test;
     };
     std::vector<THREAD_DATA> thread_data;
+    void allocate_thread_data(int tid);
+
+    struct NUMA_ARENA
+    {
+        std::unique_ptr<tbb::task_arena> arena;
+        int tid_offset; // Index of the first arena thread in thread_data
+        int nthreads;
+    };
+    std::vector<NUMA_ARENA> m_arenas;
+    int m_arena_threads = 0;
     // }
 
     // Sampling data
@@ -112,6 +416,13 @@ private:
     {
         return i_hash[(inst&i_hash_mask)];
     };
+
+    // Unscrambled Sobol points of each dimension, indexed by dimension
+    // times the table size, a power of 2 covering the samples per pixel.
+    // Pixels scramble them with their p_hash entry.
+    SAMPLER m_sampler = PAIR_SAMPLER;
+    std::vector<uint32_t> m_sobol_table;
+    uint32_t m_sobol_bits = 0;
     // }
 };
 
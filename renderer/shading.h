@@ -85,6 +85,8 @@ public:
                     float bsx, float bsy,
                     float lsx, float lsy) const;
 
+    const Imath::C3f &color() const { return m_clr; }
+
     void modulate_color(const Imath::C3f &offset)
     {
         m_clr += offset;
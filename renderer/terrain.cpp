@@ -5,11 +5,21 @@
 */
 
 #include <vector>
+#include <algorithm>
+#include <tbb/parallel_for.h>
 #include "terrain.h"
 #include "common.h"
+#include "cache.h"
 #include "ImathRandom.h"
 
 void TERRAIN::publish_ui(nlohmann::json &json_ui)
+{
+    publish_grid_ui(json_ui);
+    publish_water_ui(json_ui);
+    publish_ground_ui(json_ui);
+}
+
+void TERRAIN::publish_grid_ui(nlohmann::json &json_ui)
 {
     nlohmann::json terrain_ui = {
         {
@@ -41,13 +51,45 @@ void TERRAIN::publish_ui(nlohmann::json &json_ui)
             {"min", 0.001},
             {"max", 90.0}
         },
+        {
+            {"name", "terrain_mode"},
+            {"type", "string"},
+            {"default", "quads"},
+            {"values", {"quads", "grid"}}
+        },
+        {
+            {"name", "terrain_detail"},
+            {"type", "float"},
+            {"default", 0.25},
+            {"min", 0.01},
+            {"max", 4.0}
+        },
         {
             {"name", "terrain_levels"},
             {"type", "float"},
             {"default", 1.0},
             {"min", 0.0},
             {"max", 7.0}
-        },
+        }
+    };
+    json_ui.insert(json_ui.end(), terrain_ui.begin(), terrain_ui.end());
+}
+
+void TERRAIN::publish_ground_ui(nlohmann::json &json_ui)
+{
+    nlohmann::json ground_ui = {
+        {
+            {"name", "enable_terrain"},
+            {"type", "bool"},
+            {"default", true}
+        }
+    };
+    json_ui.insert(json_ui.end(), ground_ui.begin(), ground_ui.end());
+}
+
+void TERRAIN::publish_water_ui(nlohmann::json &json_ui)
+{
+    nlohmann::json water_ui = {
         {
             {"name", "wave_filter_width"},
             {"type", "float"},
@@ -90,75 +132,264 @@ void TERRAIN::publish_ui(nlohmann::json &json_ui)
             {"min", 1.0},
             {"max", 2.0}
         },
-        {
-            {"name", "enable_terrain"},
-            {"type", "bool"},
-            {"default", true}
-        },
         {
             {"name", "enable_water"},
             {"type", "bool"},
             {"default", false}
         }
     };
-    json_ui.insert(json_ui.end(), terrain_ui.begin(), terrain_ui.end());
+    json_ui.insert(json_ui.end(), water_ui.begin(), water_ui.end());
 }
 
-RTCGeometry TERRAIN::create_terrain_grid(RTCDevice device,
-                                         int &xres, int &yres,
-                                         Imath::V3f *&vertices,
-                                         Imath::V3f *&normals) const
+// Grid geometry is limited to 16 bit dimensions
+static const int s_max_grid_res = 32767;
+
+// Margin on the camera field of view covered by camera adaptive terrain
+static const float s_camera_margin = 1.1F;
+
+// Points of each grid surface without a memory budget, and the approximate
+// bytes of a point with its normal and BVH
+static const size_t s_max_grid_points = 1 << 24;
+static const size_t s_grid_point_bytes = 2*sizeof(Imath::V3f) + 96;
+
+// Changes of the camera that the grid built for a camera tolerates: the
+// fraction of the resolution and field of view, and the distance moved
+// relative to the near clip
+static const float s_grid_lod_tolerance = 0.1F;
+static const float s_grid_move_tolerance = 0.25F;
+
+bool TERRAIN::grid_mode() const
 {
-    RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_QUAD);
+    return m_parameters["terrain_mode"] == "grid";
+}
 
-    float terrain_size = m_parameters["terrain_size"];
-    Imath::V4f terrain_pos(m_parameters["terrain_pos"][0], m_parameters["terrain_pos"][1], 0, terrain_size);
+RTCGeometry TERRAIN::new_terrain_grid(RTCDevice device) const
+{
+    RTCGeometry geom = rtcNewGeometry(device, grid_mode() ? RTC_GEOMETRY_TYPE_GRID : RTC_GEOMETRY_TYPE_QUAD);
 
-    float terrain_near_clip = m_parameters["terrain_near_clip"];
-    float terrain_fov = m_parameters["terrain_field_of_view"];
-    float xscale = tan(radians(terrain_fov)*0.5);
-
-    float terrain_levels = m_parameters["terrain_levels"];
-    int res = std::max((int)pow(10.0, 0.5*terrain_levels), 2);
-    xres = res;
-    yres = (int)(res/xscale);
-
-    int point_count = xres*yres;
-    vertices = (Imath::V3f*) rtcSetNewGeometryBuffer(geom,
-                                                       RTC_BUFFER_TYPE_VERTEX,
-                                                       0,
-                                                       RTC_FORMAT_FLOAT3,
-                                                       sizeof(Imath::V3f),
-                                                       point_count);
     // Normal seems to be counted as a vertex attribute
     rtcSetGeometryVertexAttributeCount(geom, 1);
-    normals = (Imath::V3f*) rtcSetNewGeometryBuffer(geom,
-                                                       RTC_BUFFER_TYPE_NORMAL,
-                                                       0,
-                                                       RTC_FORMAT_FLOAT3,
-                                                       sizeof(Imath::V3f),
-                                                       point_count);
-    unsigned* indices = (unsigned*) rtcSetNewGeometryBuffer(geom,
-                                                            RTC_BUFFER_TYPE_INDEX,
-                                                            0,
-                                                            RTC_FORMAT_UINT4,
-                                                            4*sizeof(unsigned),
-                                                            (xres-1)*(yres-1));
 
+    return geom;
+}
+
+uint64_t TERRAIN::cache_key(const std::string &kind, void (*publish_surface_ui)(nlohmann::json &)) const
+{
+    nlohmann::json json_ui = nlohmann::json::array();
+    publish_grid_ui(json_ui);
+    publish_surface_ui(json_ui);
+    if (grid_mode())
+    {
+        for (const auto &name : camera_dependencies())
+        {
+            json_ui.push_back({{"name", name}});
+        }
+    }
+    return GEOMETRY_CACHE::key(kind, m_parameters, json_ui);
+}
+
+const std::vector<std::string> &TERRAIN::camera_dependencies()
+{
+    static const std::vector<std::string> names = {
+        "res", "camera_pos", "camera_yaw", "field_of_view"
+    };
+    return names;
+}
+
+bool TERRAIN::grid_lod_changed(const nlohmann::json &built, const nlohmann::json &parameters)
+{
+    if (built.is_null())
+    {
+        return true;
+    }
+
+    // The resolution follows the image width
+    int xres = parameters["res"][0];
+    int built_xres = built["res"][0];
+    if (std::abs(xres - built_xres) > built_xres * s_grid_lod_tolerance)
+    {
+        return true;
+    }
+
+    // The view has to stay within the margin of the grid, turned by the
+    // change of yaw, and zooming in far enough coarsens the quads
+    float half_fov = radians(parameters["field_of_view"].get<float>())*0.5F;
+    float built_half_fov = radians(built["field_of_view"].get<float>())*0.5F;
+    float yaw = parameters["camera_yaw"];
+    float built_yaw = built["camera_yaw"];
+    float turn = std::abs(remainder(radians(yaw - built_yaw), 2*M_PI));
+    if (half_fov + turn > atan(tan(built_half_fov) * s_camera_margin) ||
+        tan(half_fov) < tan(built_half_fov) * (1 - s_grid_lod_tolerance))
+    {
+        return true;
+    }
+
+    // Moving the camera shifts it from the near edge of the grid
+    float terrain_near_clip = parameters["terrain_near_clip"];
+    float dx = parameters["camera_pos"][0].get<float>() - built["camera_pos"][0].get<float>();
+    float dy = parameters["camera_pos"][1].get<float>() - built["camera_pos"][1].get<float>();
+    return hypot(dx, dy) > terrain_near_clip * s_grid_move_tolerance;
+}
+
+void TERRAIN::grid_resolution(int &xres, int &yres, float &xscale) const
+{
+    if (grid_mode())
+    {
+        // Cover the camera view, adapting the resolution to the image so
+        // that the quads have a constant size in pixels. The log spaced
+        // rows keep the quads roughly square.
+        float terrain_size = m_parameters["terrain_size"];
+        float terrain_near_clip = m_parameters["terrain_near_clip"];
+        float fov = m_parameters["field_of_view"];
+        float detail = m_parameters["terrain_detail"];
+        int image_xres = m_parameters["res"][0];
+        xscale = tan(radians(fov)*0.5F) * s_camera_margin;
+        auto grid_rows = [&](int columns)
+        {
+            float row_ratio = log1p(2*xscale / (columns-1));
+            return std::clamp((int)(log(terrain_size/terrain_near_clip) / row_ratio) + 1, 2, s_max_grid_res);
+        };
+        xres = std::clamp((int)(detail * image_xres * s_camera_margin), 2, s_max_grid_res);
+        yres = grid_rows(xres);
+
+        // Coarsen the grid to fit each surface in half the memory budget.
+        // The rows follow the columns, so both shrink together.
+        size_t max_points = s_max_grid_points;
+        float memory_budget = m_parameters["memory_budget"];
+        if (memory_budget > 0)
+        {
+            max_points = std::min(max_points, (size_t)(memory_budget*1e6*0.5 / s_grid_point_bytes));
+        }
+        max_points = std::max(max_points, (size_t)4);
+        while ((size_t)xres*yres > max_points && xres > 2)
+        {
+            double scale = sqrt((double)max_points / ((double)xres*yres));
+            xres = std::max((int)(xres*scale), 2);
+            yres = grid_rows(xres);
+        }
+        yres = std::min(yres, std::max((int)(max_points/xres), 2));
+    }
+    else
+    {
+        float terrain_fov = m_parameters["terrain_field_of_view"];
+        xscale = tan(radians(terrain_fov)*0.5);
+
+        float terrain_levels = m_parameters["terrain_levels"];
+        int res = std::max((int)pow(10.0, 0.5*terrain_levels), 2);
+        xres = res;
+        yres = (int)(res/xscale);
+    }
+}
+
+size_t TERRAIN::surface_memory_estimate(const BUILD_PROFILE &profile) const
+{
+    int xres, yres;
+    float xscale;
+    grid_resolution(xres, yres, xscale);
+
+    // Positions and normals, and for quads the index buffer
+    size_t points = (size_t)xres*yres;
+    size_t quads = (size_t)(xres-1)*(yres-1);
+    size_t bytes = points*2*sizeof(Imath::V3f);
+    if (!grid_mode())
+    {
+        bytes += quads*4*sizeof(unsigned);
+    }
+    return bytes + profile.bvh_estimate(quads);
+}
+
+std::vector<CACHE_BUFFER> TERRAIN::create_terrain_grid(RTCGeometry geom,
+                                                       int &xres, int &yres,
+                                                       Imath::V3f *&vertices,
+                                                       Imath::V3f *&normals) const
+{
+    float terrain_size = m_parameters["terrain_size"];
+    float terrain_near_clip = m_parameters["terrain_near_clip"];
+
+    float xscale;
+    grid_resolution(xres, yres, xscale);
+
+    // Transform from grid coordinates, with y as the distance along the
+    // view direction, to world space
+    Imath::M44f xform;
+    if (grid_mode())
+    {
+        float yaw = m_parameters["camera_yaw"];
+        xform.rotate(Imath::V3f(0, 0, -radians(yaw)));
+        xform *= Imath::M44f().translate(Imath::V3f(m_parameters["camera_pos"][0], m_parameters["camera_pos"][1], 0));
+    }
+    else
+    {
+        xform.translate(Imath::V3f(m_parameters["terrain_pos"][0], m_parameters["terrain_pos"][1], 0));
+    }
+
+    // Grids have implicit topology, so only quads need an index buffer
+    unsigned int point_count = xres*yres;
+    std::vector<CACHE_BUFFER> buffers;
+    buffers.push_back({RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, sizeof(Imath::V3f), point_count});
+    if (grid_mode())
+    {
+        buffers.push_back({RTC_BUFFER_TYPE_VERTEX_ATTRIBUTE, 0, RTC_FORMAT_FLOAT3, sizeof(Imath::V3f), point_count});
+        buffers.push_back({RTC_BUFFER_TYPE_GRID, 0, RTC_FORMAT_GRID, sizeof(RTCGrid), 1});
+    }
+    else
+    {
+        buffers.push_back({RTC_BUFFER_TYPE_NORMAL, 0, RTC_FORMAT_FLOAT3, sizeof(Imath::V3f), point_count});
+        buffers.push_back({RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT4, 4*sizeof(unsigned), (unsigned)((xres-1)*(yres-1))});
+    }
+
+    void *data[3];
+    for (int i = 0; i < 3; i++)
+    {
+        const CACHE_BUFFER &b = buffers[i];
+        data[i] = rtcSetNewGeometryBuffer(geom, b.type, b.slot, b.format, b.stride, b.count);
+    }
+
+    // Allocation fails when over the memory budget
+    if (!data[0] || !data[1] || !data[2])
+    {
+        vertices = nullptr;
+        normals = nullptr;
+        return {};
+    }
+    vertices = (Imath::V3f*) data[0];
+    normals = (Imath::V3f*) data[1];
+    unsigned* indices = nullptr;
+
+    if (grid_mode())
+    {
+        RTCGrid *grid = (RTCGrid*) data[2];
+        grid->startVertexID = 0;
+        grid->stride = xres;
+        grid->width = xres;
+        grid->height = yres;
+    }
+    else
+    {
+        indices = (unsigned*) data[2];
+    }
+
+    // Cancelled grids are returned without vertices like failed ones
     int voff = 0;
     int ioff = 0;
     for (int y = 0; y < yres; y++)
     {
+        if (BUILD_PROFILE::cancelled())
+        {
+            vertices = nullptr;
+            normals = nullptr;
+            return {};
+        }
+
         float ypos = exp(Imath::lerp(log(terrain_near_clip),
                                      log(terrain_size),
                                      y/(float)(yres-1)));
         for (int x = 0; x < xres; x++, voff++)
         {
             float xpos = ypos * (x/(float)(xres-1) - 0.5F) * xscale * 2;
-            vertices[voff][0] = xpos + terrain_pos[0];
-            vertices[voff][1] = ypos + terrain_pos[1];
+            vertices[voff] = Imath::V3f(xpos, ypos, 0) * xform;
             vertices[voff][2] = 0; // To be filled out by the caller
-            if (y < yres-1 && x < xres-1)
+            if (indices && y < yres-1 && x < xres-1)
             {
                 indices[4*ioff+0] = y*xres+x;
                 indices[4*ioff+1] = y*xres+x+1;
@@ -169,91 +400,165 @@ RTCGeometry TERRAIN::create_terrain_grid(RTCDevice device,
         }
     }
 
-    return geom;
+    return buffers;
 }
 
 static void calculate_normals(Imath::V3f* normals, const Imath::V3f* vertices, int xres, int yres)
 {
-    // Calculate smooth normals
-    memset(normals, 0, xres*yres*sizeof(Imath::V3f));
-    for (int y = 0; y < yres-1; y++)
+    // Calculate smooth normals. Each vertex gathers the corner normals of
+    // the quads around it, in the same order as the quads would scatter
+    // them, so rows can be computed independently.
+    tbb::parallel_for(tbb::blocked_range<int>(0, yres), [&](const tbb::blocked_range<int> &rows)
     {
-        for (int x = 0; x < xres-1; x++)
+        for (int y = rows.begin(); y < rows.end(); y++)
         {
-            int voff = y*xres + x;
-            Imath::V3f u0 = vertices[voff+1]-vertices[voff];
-            Imath::V3f v0 = vertices[voff+xres]-vertices[voff];
-            Imath::V3f u1 = vertices[voff+xres+1]-vertices[voff+xres];
-            Imath::V3f v1 = vertices[voff+xres+1]-vertices[voff+1];
-            Imath::V3f n00 = u0.cross(v0);
-            Imath::V3f n01 = u0.cross(v1);
-            Imath::V3f n10 = u1.cross(v0);
-            Imath::V3f n11 = u1.cross(v1);
-            normals[y*xres+x] += n00*0.25;
-            normals[y*xres+x+1] += n01*0.25;
-            normals[(y+1)*xres+x] += n10*0.25;
-            normals[(y+1)*xres+x+1] += n11*0.25;
+            for (int x = 0; x < xres; x++)
+            {
+                int voff = y*xres + x;
+                const Imath::V3f &p = vertices[voff];
+                Imath::V3f n(0);
+                if (y > 0)
+                {
+                    Imath::V3f v = p - vertices[voff-xres];
+                    if (x > 0)
+                    {
+                        Imath::V3f u = p - vertices[voff-1];
+                        n += u.cross(v)*0.25;
+                    }
+                    if (x < xres-1)
+                    {
+                        Imath::V3f u = vertices[voff+1] - p;
+                        n += u.cross(v)*0.25;
+                    }
+                }
+                if (y < yres-1)
+                {
+                    Imath::V3f v = vertices[voff+xres] - p;
+                    if (x > 0)
+                    {
+                        Imath::V3f u = p - vertices[voff-1];
+                        n += u.cross(v)*0.25;
+                    }
+                    if (x < xres-1)
+                    {
+                        Imath::V3f u = vertices[voff+1] - p;
+                        n += u.cross(v)*0.25;
+                    }
+                }
+
+                // Consistently scale all normals
+                if (x == 0 || x == xres-1) n *= 2;
+                if (y == 0 || y == yres-1) n *= 2;
+
+                normals[voff] = n;
+            }
         }
-    }
+    });
+}
 
-    // Consistently scale all normals
-    for (int y = 0; y < yres; y++)
-    {
-        normals[y*xres] *= 2;
-        normals[y*xres+xres-1] *= 2;
-    }
-    for (int x = 0; x < xres; x++)
-    {
-        normals[x] *= 2;
-        normals[(yres-1)*xres+x] *= 2;
-    }
+// Branch free sine for vectorized loops, accurate to about 1e-6 for
+// moderate arguments
+static inline float vector_sin(float x)
+{
+    const float inv_pi = 0.318309886F;
+    const float pi_hi = 3.140625F;
+    const float pi_lo = 9.67653589793e-4F;
+
+    // Reduce to [-pi/2, pi/2], flipping the sign for odd multiples of pi
+    int k = (int)(x*inv_pi + (x >= 0 ? 0.5F : -0.5F));
+    float r = (x - k*pi_hi) - k*pi_lo;
+    float r2 = r*r;
+    float s = r + r*r2*(-1.66666667e-1F + r2*(8.33333333e-3F + r2*(-1.98412698e-4F +
+                  r2*(2.75573192e-6F - r2*2.50521084e-8F))));
+    return (k & 1) ? -s : s;
 }
 
+// Box filtered sin over a width of fw, which is sin(x)*sin(h)/h for a half
+// width h
 static inline float filtered_sin(float x, float fw)
 {
-    if (fw == 0) return sin(x);
-    return (cos(x-0.5*fw)-cos(x+0.5*fw)) / fw;
+    float h = 0.5F*fw;
+    float sinc = h > 1e-4F ? vector_sin(h) / h : 1.0F;
+    return vector_sin(x) * sinc;
 }
 
-void TERRAIN::embree_geometry(RTCDevice device, RTCScene scene,
-                              std::vector<int> &shader_index,
-                              const std::vector<std::string> &shader_names) const
+unsigned int TERRAIN::ground_geometry(RTCDevice device, RTCScene scene,
+                                      std::vector<int> &shader_index,
+                                      const std::vector<std::string> &shader_names) const
 {
-    // Ground
-    if (m_parameters["enable_terrain"])
+    if (!m_parameters["enable_terrain"])
+    {
+        return RTC_INVALID_GEOMETRY_ID;
+    }
+
+    RTCGeometry geom = new_terrain_grid(device);
+
+    uint64_t key = cache_key("ground", publish_ground_ui);
+    if (!GEOMETRY_CACHE::load(key, geom))
     {
         int xres, yres;
         Imath::V3f *vertices;
         Imath::V3f *normals;
-        RTCGeometry geom = create_terrain_grid(device, xres, yres, vertices, normals);
+        auto buffers = create_terrain_grid(geom, xres, yres, vertices, normals);
+        if (!vertices)
+        {
+            rtcReleaseGeometry(geom);
+            return RTC_INVALID_GEOMETRY_ID;
+        }
 
         int voff = 0;
-        for (int y = 0; y < yres; y++)
+        for (int y = 0; y < yres && !BUILD_PROFILE::cancelled(); y++)
         {
             for (int x = 0; x < xres; x++, voff++)
             {
                 vertices[voff][2] = 0.5*(sin(vertices[voff][0]) + sin(vertices[voff][1]));
             }
         }
+        if (BUILD_PROFILE::abandoned())
+        {
+            rtcReleaseGeometry(geom);
+            return RTC_INVALID_GEOMETRY_ID;
+        }
 
         calculate_normals(normals, vertices, xres, yres);
 
-        rtcCommitGeometry(geom);
+        GEOMETRY_CACHE::store(key, geom, buffers);
+    }
+
+    rtcCommitGeometry(geom);
+
+    unsigned int id = rtcAttachGeometry(scene, geom);
+    int shader_id = BRDF::find_shader(shader_names, "default");
+    BRDF::set_shader_index(shader_index, id, shader_id);
 
-        unsigned int id = rtcAttachGeometry(scene, geom);
-        int shader_id = BRDF::find_shader(shader_names, "default");
-        BRDF::set_shader_index(shader_index, id, shader_id);
+    rtcReleaseGeometry(geom);
 
-        rtcReleaseGeometry(geom);
+    return id;
+}
+
+unsigned int TERRAIN::water_geometry(RTCDevice device, RTCScene scene,
+                                     std::vector<int> &shader_index,
+                                     const std::vector<std::string> &shader_names) const
+{
+    if (!m_parameters["enable_water"])
+    {
+        return RTC_INVALID_GEOMETRY_ID;
     }
 
-    // Water
-    if (m_parameters["enable_water"])
+    RTCGeometry geom = new_terrain_grid(device);
+
+    uint64_t key = cache_key("water", publish_water_ui);
+    if (!GEOMETRY_CACHE::load(key, geom))
     {
         int xres, yres;
         Imath::V3f *vertices;
         Imath::V3f *normals;
-        RTCGeometry geom = create_terrain_grid(device, xres, yres, vertices, normals);
+        auto buffers = create_terrain_grid(geom, xres, yres, vertices, normals);
+        if (!vertices)
+        {
+            rtcReleaseGeometry(geom);
+            return RTC_INVALID_GEOMETRY_ID;
+        }
 
         struct WAVE {
             Imath::V2f dir;
@@ -288,30 +593,60 @@ void TERRAIN::embree_geometry(RTCDevice device, RTCScene scene,
         // Calculate normals to find vertex filter area
         calculate_normals(normals, vertices, xres, yres);
 
-        int voff = 0;
-        for (int y = 0; y < yres; y++)
+        // Displace rows in parallel. Within a row each wave is evaluated
+        // for all vertices at once so that the loop vectorizes. Waves are
+        // in increasing frequency, so masking the waves whose filter width
+        // exceeds a period is equivalent to stopping at the first one.
+        tbb::parallel_for(tbb::blocked_range<int>(0, yres), [&](const tbb::blocked_range<int> &rows)
         {
-            for (int x = 0; x < xres; x++, voff++)
+            std::vector<float> width(xres);
+            std::vector<float> height(xres);
+            for (int y = rows.begin(); y < rows.end() && !BUILD_PROFILE::cancelled(); y++)
             {
-                float width = sqrt(normals[voff].length()) * filter_width;
+                Imath::V3f *row = vertices + y*xres;
+                const Imath::V3f *row_normals = normals + y*xres;
+                for (int x = 0; x < xres; x++)
+                {
+                    width[x] = sqrtf(row_normals[x].length()) * filter_width;
+                    height[x] = 0;
+                }
+
                 for (const WAVE &w : spectrum)
                 {
-                    float fwidth = width * w.freq;
-                    if (fwidth > 2*M_PI) break;
-                    vertices[voff][2] += w.amp*filtered_sin(w.freq*Imath::V2f(vertices[voff][0], vertices[voff][1]).dot(w.dir), fwidth);
+                    for (int x = 0; x < xres; x++)
+                    {
+                        float fwidth = width[x] * w.freq;
+                        float phase = w.freq*(row[x][0]*w.dir[0] + row[x][1]*w.dir[1]);
+                        float wave = w.amp*filtered_sin(phase, fwidth);
+                        height[x] += (fwidth <= 2*M_PI) ? wave : 0.0F;
+                    }
+                }
+
+                for (int x = 0; x < xres; x++)
+                {
+                    row[x][2] += height[x];
                 }
             }
+        });
+        if (BUILD_PROFILE::abandoned())
+        {
+            rtcReleaseGeometry(geom);
+            return RTC_INVALID_GEOMETRY_ID;
         }
 
         calculate_normals(normals, vertices, xres, yres);
 
-        rtcCommitGeometry(geom);
+        GEOMETRY_CACHE::store(key, geom, buffers);
+    }
 
-        unsigned int id = rtcAttachGeometry(scene, geom);
-        int shader_id = BRDF::find_shader(shader_names, "water");
-        BRDF::set_shader_index(shader_index, id, shader_id);
+    rtcCommitGeometry(geom);
 
-        rtcReleaseGeometry(geom);
-    }
+    unsigned int id = rtcAttachGeometry(scene, geom);
+    int shader_id = BRDF::find_shader(shader_names, "water");
+    BRDF::set_shader_index(shader_index, id, shader_id);
+
+    rtcReleaseGeometry(geom);
+
+    return id;
 }
 
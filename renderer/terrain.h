@@ -10,6 +10,8 @@
 #include <embree3/rtcore.h>
 #include <nlohmann/json.hpp>
 #include "shading.h"
+#include "cache.h"
+#include "profile.h"
 
 class TERRAIN
 {
@@ -20,15 +22,53 @@ public:
 
     static void publish_ui(nlohmann::json &json_ui);
 
-    void embree_geometry(RTCDevice device, RTCScene scene,
-                         std::vector<int> &shader_index,
-                         const std::vector<std::string> &shader_names) const;
+    // The grid parameters affect both surfaces, and the remaining subsets
+    // only affect one of them
+    static void publish_grid_ui(nlohmann::json &json_ui);
+    static void publish_ground_ui(nlohmann::json &json_ui);
+    static void publish_water_ui(nlohmann::json &json_ui);
+
+    // Scene parameters that the terrain depends on in grid mode, which
+    // follows the camera
+    static const std::vector<std::string> &camera_dependencies();
+
+    // Whether the grid built for the camera dependencies in built no
+    // longer covers the camera in parameters at its level of detail. Small
+    // camera changes keep the grid.
+    static bool grid_lod_changed(const nlohmann::json &built, const nlohmann::json &parameters);
+
+    // Each surface is a separate geometry so that it can be rebuilt on its
+    // own. Returns the attached geometry ID, or RTC_INVALID_GEOMETRY_ID if
+    // the surface is disabled.
+    unsigned int ground_geometry(RTCDevice device, RTCScene scene,
+                                 std::vector<int> &shader_index,
+                                 const std::vector<std::string> &shader_names) const;
+    unsigned int water_geometry(RTCDevice device, RTCScene scene,
+                                std::vector<int> &shader_index,
+                                const std::vector<std::string> &shader_names) const;
+
+    // Approximate Embree memory in bytes of one surface, from the grid
+    // resolution
+    size_t surface_memory_estimate(const BUILD_PROFILE &profile) const;
 
 private:
-    RTCGeometry create_terrain_grid(RTCDevice device,
-                                    int &xres, int &yres,
-                                    Imath::V3f *&vertices,
-                                    Imath::V3f *&normals) const;
+    // Whether to use camera adaptive grid geometry rather than quads
+    bool grid_mode() const;
+
+    RTCGeometry new_terrain_grid(RTCDevice device) const;
+
+    // Vertex resolution of the grid, limited by the memory budget, and the
+    // half width of its far edge relative to its distance
+    void grid_resolution(int &xres, int &yres, float &xscale) const;
+
+    // Cache key for a surface given the parameters specific to it
+    uint64_t cache_key(const std::string &kind, void (*publish_surface_ui)(nlohmann::json &)) const;
+
+    // Allocate and fill the grid buffers of geom, returning their layout
+    std::vector<CACHE_BUFFER> create_terrain_grid(RTCGeometry geom,
+                                                  int &xres, int &yres,
+                                                  Imath::V3f *&vertices,
+                                                  Imath::V3f *&normals) const;
 
 private:
     nlohmann::json m_parameters;
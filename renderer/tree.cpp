@@ -5,35 +5,73 @@
 */
 
 #include <vector>
+#include <algorithm>
+#include <tbb/parallel_invoke.h>
+#include <tbb/parallel_for.h>
 #include "tree.h"
 #include "common.h"
+#include "cache.h"
 
 // Maximum number of branches
 static const int s_max_branch = 10;
 
-void POLY_CURVE::branch_geometry(const Imath::M44f &m, Imath::V4f *vertices, int &vidx, unsigned *indices, int &iidx) const
+// Subtrees with more leaves than this are constructed in parallel
+static const float s_parallel_leaf_count = 1e4F;
+
+// Projected tree height in pixels below which forests use a coarser level
+// of detail
+static const float s_lod_full_detail_pixels = 256.0F;
+
+// Buffer layouts of the tree geometry for the cache
+static std::vector<CACHE_BUFFER> branch_buffers(unsigned int point_count, unsigned int curve_count)
 {
-    for (int i = 0; i < m_pos_r.size(); i++)
-    {
-        // Assume m has no scaling transform
-        auto pos = m_pos_r[i].first * m;
-        float r = m_pos_r[i].second;
-        if (i < m_pos_r.size()-1)
-        {
-            indices[iidx++] = vidx;
-        }
-        vertices[vidx++] = Imath::V4f(pos[0], pos[1], pos[2], r);
-    }
+    return {
+        {RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(Imath::V4f), point_count},
+        {RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT, sizeof(unsigned), point_count - curve_count}
+    };
+}
+
+static std::vector<CACHE_BUFFER> leaf_buffers(unsigned int curve_count)
+{
+    return {
+        {RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT4, sizeof(Imath::V4f), curve_count},
+        {RTC_BUFFER_TYPE_NORMAL, 0, RTC_FORMAT_FLOAT3, sizeof(Imath::V3f), curve_count}
+    };
+}
+
+void TREE_DATA::reserve(int leaves)
+{
+    // Each leaf ends one curve, and the binary construction creates two
+    // groups and about three vertices per leaf
+    m_xforms.reserve(2*leaves);
+    m_parents.reserve(2*leaves);
+    m_curve_groups.reserve(leaves);
+    m_curve_starts.reserve(leaves);
+    m_leaf_radii.reserve(leaves);
+    m_pos_r.reserve(3*leaves);
 }
 
-void POLY_CURVE::leaf_geometry(const Imath::M44f &m, int &idx, Imath::V4f *vertices, Imath::V3f *normals) const
+void TREE_DATA::append(const TREE_DATA &sub, int external_group)
 {
-    auto pos = m_pos_r.back().first * m;
-    auto ppos = m_pos_r[m_pos_r.size()-2].first * m;
+    int group_offset = m_xforms.size();
+    int point_offset = m_pos_r.size();
+
+    auto remap = [&](int g) { return g < 0 ? external_group : g + group_offset; };
 
-    vertices[idx] = Imath::V4f(pos[0], pos[1], pos[2], m_leaf_radius);
-    normals[idx] = pos - ppos;
-    idx++;
+    m_xforms.insert(m_xforms.end(), sub.m_xforms.begin(), sub.m_xforms.end());
+    for (int parent : sub.m_parents)
+    {
+        m_parents.push_back(remap(parent));
+    }
+
+    for (int c = 0; c < sub.curve_count(); c++)
+    {
+        m_curve_groups.push_back(remap(sub.m_curve_groups[c]));
+        m_curve_starts.push_back(sub.m_curve_starts[c] + point_offset);
+    }
+    m_leaf_radii.insert(m_leaf_radii.end(), sub.m_leaf_radii.begin(), sub.m_leaf_radii.end());
+
+    m_pos_r.insert(m_pos_r.end(), sub.m_pos_r.begin(), sub.m_pos_r.end());
 }
 
 void TREE::publish_ui(nlohmann::json &json_ui)
@@ -138,44 +176,80 @@ void TREE::publish_ui(nlohmann::json &json_ui)
     json_ui.insert(json_ui.end(), tree_ui.begin(), tree_ui.end());
 }
 
+TREE_PARAMS::TREE_PARAMS(const nlohmann::json &parameters)
+    : tree_seed(parameters["tree_seed"])
+    , levels(parameters["levels"])
+    , tree_height(parameters["tree_height"])
+    , trunk_radius_ratio(parameters["trunk_radius_ratio"])
+    , leaf_area_ratio(parameters["leaf_area_ratio"])
+    , branch_ratio(parameters["branch_ratio"])
+    , branch_ratio_variance(parameters["branch_ratio_variance"])
+    , branch_length_exponent(parameters["branch_length_exponent"])
+    , da_vinci_exponent(parameters["da_vinci_exponent"])
+    , branch_spread_angle(parameters["branch_spread_angle"])
+    , branch_twist_angle(parameters["branch_twist_angle"])
+    , branch_angle_variance(parameters["branch_angle_variance"])
+    , enable_leaves(parameters["enable_leaves"])
+    , lod_leaf_count(parameters.value("lod_leaf_count", 1.0F))
+{
+    // Hash every published tree parameter so that the cache stays correct
+    // as parameters are added, whether or not they have a field here
+    nlohmann::json tree_ui = nlohmann::json::array();
+    TREE::publish_ui(tree_ui);
+
+    nlohmann::json json_ui = nlohmann::json::array();
+    for (const auto &p : tree_ui)
+    {
+        if (p["name"] != "tree_seed")
+        {
+            json_ui.push_back(p);
+        }
+    }
+    hash = GEOMETRY_CACHE::key("tree", parameters, json_ui);
+}
+
 void TREE::build()
 {
     // Determine the initial trunk radius of the tree
-    float height = m_parameters["tree_height"];
-    float radius = m_parameters["trunk_radius_ratio"];
+    float height = m_params.tree_height;
+    float radius = m_params.trunk_radius_ratio;
     radius *= height;
-    float leaf_count = m_parameters["levels"];
+    float leaf_count = m_params.levels;
     leaf_count = pow(10.0, leaf_count);
 
-    m_leaf_radius = m_parameters["leaf_area_ratio"];
+    m_leaf_radius = m_params.leaf_area_ratio;
     m_leaf_radius = sqrt(m_leaf_radius / leaf_count);
     m_leaf_radius *= height;
 
-    POLY_CURVE *trunk = new POLY_CURVE;
+    // Each leaf of a truncated tree stands in for about lod_leaf_count
+    // leaves, so scale it to preserve the leaf area
+    m_leaf_radius *= sqrt(m_params.lod_leaf_count);
+
+    m_data = TREE_DATA();
+    m_data.reserve((int)leaf_count);
+
+    int root = m_data.add_group(-1);
+    m_data.add_curve(root);
+
     float weight;
     float center_of_mass;
-    construct(m_root, *trunk, weight, center_of_mass, m_root_seed, radius, leaf_count);
-    m_root.add_child(trunk);
+    construct(m_data, root, weight, center_of_mass, m_params.tree_seed, radius, leaf_count);
 
-    // Scale the whole tree to the desired size
-    float trunk_len = 0.0;
-    for (int i = 0; i < trunk->m_pos_r.size()-1; i++)
-    {
-        trunk_len += (trunk->m_pos_r[i+1].first - trunk->m_pos_r[i].first).length();
-    }
-
-    m_root.m_xform.setScale(height / trunk_len);
+    // Scale the whole tree to the desired size, using the trunk length at
+    // full detail so that every level of detail has the same size
+    float trunk_len = trunk_length(m_params.tree_seed, radius, leaf_count);
+    m_data.m_xforms[root].setScale(height / trunk_len);
 }
 
-void TREE::construct(GROUP_NODE& local, POLY_CURVE &trunk,
-                     float &weight, float &center_of_mass,
-                     uint32_t seed, float radius, float leaf_count)
+int TREE::construct(TREE_DATA &data, int group,
+                    float &weight, float &center_of_mass,
+                    uint32_t seed, float radius, float leaf_count) const
 {
     Imath::Rand32 lrand(seed);
     float length = 1.0;
-    float branch_ratio = m_parameters["branch_ratio"];
-    float branch_ratio_variance = m_parameters["branch_ratio_variance"];
-    float branch_length_exponent = m_parameters["branch_length_exponent"];
+    float branch_ratio = m_params.branch_ratio;
+    float branch_ratio_variance = m_params.branch_ratio_variance;
+    float branch_length_exponent = m_params.branch_length_exponent;
 
     branch_ratio *= lrand.nextf(1.0F-branch_ratio_variance, 1.0F);
 
@@ -185,22 +259,31 @@ void TREE::construct(GROUP_NODE& local, POLY_CURVE &trunk,
     weight = 0;
     center_of_mass = 0;
 
-    trunk.m_pos_r.push_back(std::make_pair(Imath::V3f(0, 0, 0), radius));
-    if (branch_ratio * leaf_count <= 1.0F)
+    // Only the trunk vertices are transformed with the continuation, since
+    // the side branches below it are placed by their own groups
+    int trunk_end;
+    // Large subtrees stop branching once the build is cancelled, since the
+    // tree will be discarded
+    data.m_pos_r.push_back(Imath::V4f(0, 0, 0, radius));
+    if (branch_ratio * leaf_count <= m_params.lod_leaf_count ||
+        (leaf_count > s_parallel_leaf_count && BUILD_PROFILE::cancelled()))
     {
-        length *= leaf_count;
-        trunk.m_pos_r.push_back(std::make_pair(Imath::V3f(0, 0, length), radius));
-        trunk.m_leaf_radius = m_leaf_radius;
-        trunk.m_leaf_radius *= lrand.nextf(0.5F, 1.25F);
+        // A truncated branch spans the trunk of the subtree it replaces
+        length = branch_ratio * leaf_count <= 1.0F
+               ? length * leaf_count
+               : trunk_length(seed, radius, leaf_count);
+        data.m_pos_r.push_back(Imath::V4f(0, 0, length, radius));
+        data.m_leaf_radii.back() = m_leaf_radius * lrand.nextf(0.5F, 1.25F);
+        trunk_end = data.point_count();
     }
     else
     {
-        float da_vinci_exponent = m_parameters["da_vinci_exponent"];
-        float angle_var = m_parameters["branch_angle_variance"];
+        float da_vinci_exponent = m_params.da_vinci_exponent;
+        float angle_var = m_params.branch_angle_variance;
         float area = pow(radius, da_vinci_exponent);
 
-        float spread = m_parameters["branch_spread_angle"];
-        float twist = m_parameters["branch_twist_angle"];
+        float spread = m_params.branch_spread_angle;
+        float twist = m_params.branch_twist_angle;
 
         spread += lrand.nextf(-angle_var, angle_var);
         twist += lrand.nextf(-angle_var, angle_var);
@@ -214,27 +297,56 @@ void TREE::construct(GROUP_NODE& local, POLY_CURVE &trunk,
 
         // Treat the larger branch as a continuation of the trunk
         int larger_idx = 1;
-        int trunk_idx = trunk.m_pos_r.size();
+        int trunk_idx = data.point_count();
 
-        GROUP_NODE *children[2];
+        // Draw the child seeds up front so that the subtrees are
+        // independent of the order they are built in
+        uint32_t seeds[2];
+        for (int i = 0; i < 2; i++)
+        {
+            seeds[i] = lrand.nexti();
+        }
 
-        // Build the child branches then set angles in a second pass given the
-        // known downstream weight and height of center of mass
+        // Create transformation groups for the new subtrees
+        int children[2];
         for (int i = 0; i < 2; i++)
         {
-            // Create transformation nodes for the new subtree
-            children[i] = new GROUP_NODE;
+            children[i] = data.add_group(group);
+        }
 
-            if (i == larger_idx)
-            {
-                construct(*children[i], trunk, w[i], c[i], lrand.nexti(), r[i], l[i]);
-            }
-            else
-            {
-                POLY_CURVE *branch = new POLY_CURVE;
-                construct(*children[i], *branch, w[i], c[i], lrand.nexti(), r[i], l[i]);
-                children[i]->add_child(branch);
-            }
+        // Build the child branches then set angles in a second pass given the
+        // known downstream weight and height of center of mass. The trunk
+        // continuation is built first so that its vertices stay contiguous
+        // with the rest of the trunk, followed by the side branch as a new
+        // curve.
+        if (leaf_count > s_parallel_leaf_count)
+        {
+            // Build the side branch into its own arena concurrently with the
+            // continuation and append it afterwards
+            TREE_DATA branch;
+            tbb::parallel_invoke(
+                [&]
+                {
+                    trunk_end = construct(data, children[larger_idx], w[larger_idx], c[larger_idx],
+                                          seeds[larger_idx], r[larger_idx], l[larger_idx]);
+                },
+                [&]
+                {
+                    int i = 1-larger_idx;
+                    branch.reserve((int)l[i]);
+                    branch.add_curve(-1);
+                    construct(branch, -1, w[i], c[i], seeds[i], r[i], l[i]);
+                });
+            data.append(branch, children[1-larger_idx]);
+        }
+        else
+        {
+            int i = larger_idx;
+            trunk_end = construct(data, children[i], w[i], c[i], seeds[i], r[i], l[i]);
+
+            i = 1-larger_idx;
+            data.add_curve(children[i]);
+            construct(data, children[i], w[i], c[i], seeds[i], r[i], l[i]);
         }
 
         weight = w[0] + w[1];
@@ -248,14 +360,15 @@ void TREE::construct(GROUP_NODE& local, POLY_CURVE &trunk,
             Imath::M44f t;
             t.translate(position);
             t.rotate(Imath::V3f(radians(angle), 0, radians(twist)));
-            children[i]->set_transform(t);
-            local.add_child(children[i]);
+            data.m_xforms[children[i]] = t;
 
             if (i == larger_idx)
             {
-                for (int j = trunk_idx; j < trunk.m_pos_r.size(); j++)
+                for (int j = trunk_idx; j < trunk_end; j++)
                 {
-                    trunk.m_pos_r[j].first *= t;
+                    Imath::V4f &p = data.m_pos_r[j];
+                    Imath::V3f pos = Imath::V3f(p[0], p[1], p[2]) * t;
+                    p = Imath::V4f(pos[0], pos[1], pos[2], p[3]);
                 }
             }
 
@@ -267,15 +380,122 @@ void TREE::construct(GROUP_NODE& local, POLY_CURVE &trunk,
     center_of_mass = (center_of_mass + length) * weight + length * 0.5F * stem_weight;
     weight += stem_weight;
     center_of_mass /= weight;
+
+    return trunk_end;
+}
+
+float TREE::trunk_length(uint32_t seed, float radius, float leaf_count) const
+{
+    // Draws the same random numbers as construct() along the trunk
+    float total = 0;
+    while (true)
+    {
+        Imath::Rand32 lrand(seed);
+        float branch_ratio = m_params.branch_ratio;
+        branch_ratio *= lrand.nextf(1.0F-m_params.branch_ratio_variance, 1.0F);
+
+        float length = 1.0;
+        length *= pow(radius, m_params.branch_length_exponent);
+        length *= branch_ratio;
+        if (branch_ratio * leaf_count <= 1.0F)
+        {
+            return total + length * leaf_count;
+        }
+        total += length;
+
+        // Spread and twist, then the seeds of the children
+        float angle_var = m_params.branch_angle_variance;
+        lrand.nextf(-angle_var, angle_var);
+        lrand.nextf(-angle_var, angle_var);
+        lrand.nexti();
+        seed = lrand.nexti();
+
+        // Continue with the larger child
+        float area = pow(radius, m_params.da_vinci_exponent);
+        radius = pow(area*(1.0F-branch_ratio), 1.0F/m_params.da_vinci_exponent);
+        leaf_count *= 1.0F-branch_ratio;
+    }
+}
+
+size_t TREE::memory_estimate(const BUILD_PROFILE &profile) const
+{
+    // Each leaf ends a curve. The binary tree has about one vertex per
+    // branch point and two per leaf, with a segment per vertex but the last
+    // of each curve.
+    size_t curves = (size_t)std::max(pow(10.0, m_params.levels) / m_params.lod_leaf_count, 1.0);
+    size_t points = 3*curves;
+    size_t segments = points - curves;
+    size_t bytes = points*sizeof(Imath::V4f) + segments*sizeof(unsigned) + profile.bvh_estimate(segments);
+    if (m_params.enable_leaves)
+    {
+        bytes += curves*(sizeof(Imath::V4f) + sizeof(Imath::V3f)) + profile.bvh_estimate(curves);
+    }
+    return bytes;
+}
+
+uint64_t TREE::cache_key(const std::string &kind) const
+{
+    return GEOMETRY_CACHE::combine(m_params.hash, kind + std::to_string(m_params.tree_seed) +
+                                   "_" + std::to_string(m_params.lod_leaf_count));
+}
+
+bool TREE::cached_geometry(RTCDevice device, RTCScene scene,
+                           std::vector<int> &shader_index,
+                           const std::vector<std::string> &shader_names) const
+{
+    RTCGeometry branches = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_ROUND_LINEAR_CURVE);
+    RTCGeometry leaves = nullptr;
+    bool found = GEOMETRY_CACHE::load(cache_key("branches"), branches);
+    if (found && m_params.enable_leaves)
+    {
+        leaves = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_ORIENTED_DISC_POINT);
+        found = GEOMETRY_CACHE::load(cache_key("leaves"), leaves);
+    }
+
+    auto attach = [&](RTCGeometry geom, const char *shader)
+    {
+        if (!geom)
+        {
+            return;
+        }
+        if (found)
+        {
+            rtcCommitGeometry(geom);
+            unsigned int id = rtcAttachGeometry(scene, geom);
+            BRDF::set_shader_index(shader_index, id, BRDF::find_shader(shader_names, shader));
+        }
+        rtcReleaseGeometry(geom);
+    };
+    attach(branches, "branch");
+    attach(leaves, "leaf");
+
+    return found;
 }
 
 void TREE::embree_geometry(RTCDevice device, RTCScene scene,
                            std::vector<int> &shader_index,
                            const std::vector<std::string> &shader_names) const
 {
-    int curve_count = 0;
-    int point_count = 0;
-    m_root.geometry_size(curve_count, point_count);
+    const TREE_DATA &data = m_data;
+    int curve_count = data.curve_count();
+    int point_count = data.point_count();
+
+    // Resolve world transforms in one pass, since parents precede children
+    std::vector<Imath::M44f> world(data.m_xforms.size());
+    for (int g = 0; g < world.size(); g++)
+    {
+        int parent = data.m_parents[g];
+        world[g] = parent < 0 ? data.m_xforms[g] : data.m_xforms[g] * world[parent];
+    }
+
+    // Curve c owns vertices [start, end) and the indices of all but its last
+    // vertex, so its first index is start - c
+    auto transform = [&](int c, int i)
+    {
+        // Assume the transform has no scaling
+        const Imath::V4f &p = data.m_pos_r[i];
+        return Imath::V3f(p[0], p[1], p[2]) * world[data.m_curve_groups[c]];
+    };
 
     {
         int branch_shader = BRDF::find_shader(shader_names, "branch");
@@ -295,11 +515,30 @@ void TREE::embree_geometry(RTCDevice device, RTCScene scene,
                                                                 sizeof(unsigned),
                                                                 point_count - curve_count);
 
-        int vidx = 0;
-        int iidx = 0;
-        m_root.branch_geometry(Imath::M44f(), vertices, vidx, indices, iidx);
-        assert(vidx == point_count);
-        assert(iidx == point_count - curve_count);
+        // Allocation fails when over the memory budget
+        if (!vertices || !indices)
+        {
+            rtcReleaseGeometry(geom);
+            return;
+        }
+
+        tbb::parallel_for(0, curve_count, [&](int c)
+        {
+            int start = data.m_curve_starts[c];
+            int end = data.curve_end(c);
+            int iidx = start - c;
+            for (int i = start; i < end; i++)
+            {
+                auto pos = transform(c, i);
+                if (i < end-1)
+                {
+                    indices[iidx++] = i;
+                }
+                vertices[i] = Imath::V4f(pos[0], pos[1], pos[2], data.m_pos_r[i][3]);
+            }
+        });
+
+        GEOMETRY_CACHE::store(cache_key("branches"), geom, branch_buffers(point_count, curve_count));
 
         rtcCommitGeometry(geom);
 
@@ -308,7 +547,7 @@ void TREE::embree_geometry(RTCDevice device, RTCScene scene,
         rtcReleaseGeometry(geom);
     }
 
-    if (m_parameters["enable_leaves"])
+    if (m_params.enable_leaves)
     {
         int leaf_shader = BRDF::find_shader(shader_names, "leaf");
 
@@ -325,10 +564,23 @@ void TREE::embree_geometry(RTCDevice device, RTCScene scene,
                                                            RTC_FORMAT_FLOAT3,
                                                            sizeof(Imath::V3f),
                                                            curve_count);
+        if (!vertices || !normals)
+        {
+            rtcReleaseGeometry(geom);
+            return;
+        }
+
+        tbb::parallel_for(0, curve_count, [&](int c)
+        {
+            int end = data.curve_end(c);
+            auto pos = transform(c, end-1);
+            auto ppos = transform(c, end-2);
+
+            vertices[c] = Imath::V4f(pos[0], pos[1], pos[2], data.m_leaf_radii[c]);
+            normals[c] = pos - ppos;
+        });
 
-        int idx = 0;
-        m_root.leaf_geometry(Imath::M44f(), idx, vertices, normals);
-        assert(idx == curve_count);
+        GEOMETRY_CACHE::store(cache_key("leaves"), geom, leaf_buffers(curve_count));
 
         rtcCommitGeometry(geom);
 
@@ -361,66 +613,291 @@ void FOREST::publish_ui(nlohmann::json &json_ui)
             {"default", 1},
             {"min", 0.1},
             {"max", 10}
+        },
+        {
+            {"name", "forest_lod"},
+            {"type", "int"},
+            {"default", 1},
+            {"min", 1},
+            {"max", 6}
+        },
+        {
+            {"name", "forest_instancing"},
+            {"type", "string"},
+            {"default", "flat"},
+#if RTC_MAX_INSTANCE_LEVEL_COUNT > 1
+            {"values", {"flat", "clustered"}}
+#else
+            // Clustering needs two level instancing
+            {"values", {"flat"}}
+#endif
         }
     };
     json_ui.insert(json_ui.end(), tree_ui.begin(), tree_ui.end());
 }
 
-void FOREST::embree_geometry(RTCDevice device, RTCScene scene,
-                           std::vector<int> &shader_index,
-                           const std::vector<std::string> &shader_names) const
+const std::vector<std::string> &FOREST::camera_dependencies()
 {
-    Imath::Rand48 lrand(m_parameters["tree_seed"]);
-    int unique_trees = m_parameters["unique_trees"];
-    std::vector<RTCScene> tree_scenes(unique_trees);
-    for (int i = 0; i < unique_trees; i++)
+    static const std::vector<std::string> names = {
+        "res", "camera_pos", "field_of_view"
+    };
+    return names;
+}
+
+// Approximate size of an instance geometry along with its transforms and
+// shading data
+static const size_t s_instance_bytes = 256;
+
+size_t FOREST::memory_estimate() const
+{
+    size_t bytes = 0;
+    int lod_count = std::max(m_lod_count, 1);
+    for (int lod = 0; lod < lod_count; lod++)
     {
-        tree_scenes[i] = rtcNewScene(device);
+        TREE_PARAMS inst_params = m_tree_params;
+        inst_params.lod_leaf_count *= (float)(1 << (2*lod));
+        bytes += m_unique_trees * TREE(inst_params).memory_estimate(m_profile);
+    }
 
-        auto inst_params = m_parameters;
-        inst_params["tree_seed"] = i;
+    size_t count = (size_t)pow(10.0, m_forest_levels);
+    return bytes + count*s_instance_bytes + m_profile.bvh_estimate(count);
+}
+
+void FOREST::build_trees(RTCDevice device,
+                         std::vector<int> &shader_index,
+                         const std::vector<std::string> &shader_names,
+                         FOREST_TREES &trees) const
+{
+    trees.release();
+    int lod_count = std::max(m_lod_count, 1);
+    trees.lod_count = lod_count;
+    std::vector<RTCScene> &tree_scenes = trees.scenes;
+    tree_scenes.resize(m_unique_trees * lod_count);
+
+    // Build the unique trees and their levels of detail concurrently, each
+    // with its own shader index table since the shader indices are shared
+    // by all tree scenes. Level i truncates the construction at 4^i times
+    // the leaves of the finest level.
+    std::vector<std::vector<int>> tree_shader_index(tree_scenes.size());
+    tbb::parallel_for(0, (int)tree_scenes.size(), [&](int i)
+    {
+        tree_scenes[i] = m_profile.new_scene(device);
+
+        TREE_PARAMS inst_params = m_tree_params;
+        inst_params.tree_seed = i / lod_count;
+        inst_params.lod_leaf_count *= (float)(1 << (2*(i % lod_count)));
 
         TREE tree(inst_params);
-        tree.build();
-        tree.embree_geometry(device, tree_scenes[i], shader_index, shader_names);
+        // Cancelled trees are left incomplete and not cached, since the
+        // trees are discarded
+        if (!BUILD_PROFILE::cancelled() &&
+            !tree.cached_geometry(device, tree_scenes[i], tree_shader_index[i], shader_names))
+        {
+            tree.build();
+            if (!BUILD_PROFILE::abandoned())
+            {
+                tree.embree_geometry(device, tree_scenes[i], tree_shader_index[i], shader_names);
+            }
+        }
 
         rtcCommitScene(tree_scenes[i]);
+    });
+
+    if (BUILD_PROFILE::abandoned())
+    {
+        return;
     }
 
-    float forest_levels = m_parameters["forest_levels"];
-    float forest_density = m_parameters["forest_density"];
+    for (const auto &tree_index : tree_shader_index)
+    {
+        for (unsigned int id = 0; id < tree_index.size(); id++)
+        {
+            if (tree_index[id] >= 0)
+            {
+                BRDF::set_shader_index(shader_index, id, tree_index[id]);
+            }
+        }
+    }
+}
+
+void FOREST::embree_geometry(RTCDevice device, RTCScene scene,
+                             const FOREST_TREES &trees,
+                             FOREST_INSTANCES &instances) const
+{
+    instances = FOREST_INSTANCES();
+
+    // The trees may have been built with fewer unique trees to fit the
+    // memory budget, which the placement below follows
+    Imath::Rand48 lrand(m_tree_params.tree_seed);
+    const std::vector<RTCScene> &tree_scenes = trees.scenes;
+    int lod_count = trees.lod_count;
+    int unique_trees = tree_scenes.size() / lod_count;
+    if (unique_trees == 0)
+    {
+        return;
+    }
+
+    float forest_levels = m_forest_levels;
+    float forest_density = m_forest_density;
     int count = (int)pow(10.0, forest_levels);
     float scale = sqrt((float)count / forest_density);
+
+    struct TREE_INSTANCE
+    {
+        float x, y, twist, scale;
+        int tree_idx;
+        int lod;
+    };
+
+    // Size in pixels of one unit of height at unit distance
+    float pixels_per_unit = m_image_xres / (2*tan(radians(m_camera_fov)*0.5F));
+
+    // Choose the level of detail from the projected tree height. Each level
+    // has a quarter of the leaves, so halves the linear detail.
+    auto choose_lod = [&](const TREE_INSTANCE &inst)
+    {
+        if (lod_count == 1)
+        {
+            return 0;
+        }
+        float dist = (Imath::V3f(inst.x, inst.y, 0) - m_camera_pos).length();
+        float pixels = m_tree_params.tree_height * inst.scale * pixels_per_unit / std::max(dist, 1e-3F);
+        int lod = (int)floor(log2(s_lod_full_detail_pixels / std::max(pixels, 1e-3F)));
+        return std::clamp(lod, 0, lod_count-1);
+    };
+
+    // Attach a tree, recording its transform in the order of the IDs
+    auto attach_instance = [&](RTCScene target, const TREE_INSTANCE &inst,
+                               std::vector<Imath::M44f> &xforms)
+    {
+        RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
+        rtcSetGeometryInstancedScene(geom, tree_scenes[inst.tree_idx*lod_count + inst.lod]);
+
+        Imath::M44f xform;
+        xform.translate(Imath::V3f(inst.x, inst.y, 0));
+        xform.rotate(Imath::V3f(0, 0, radians(inst.twist)));
+        xform.scale(Imath::V3f(inst.scale));
+
+        rtcSetGeometryTransform(geom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &xform);
+        rtcCommitGeometry(geom);
+
+        unsigned int id = rtcAttachGeometry(target, geom);
+        rtcReleaseGeometry(geom);
+        xforms.push_back(xform);
+        return id;
+    };
+
+#if RTC_MAX_INSTANCE_LEVEL_COUNT > 1
+    const bool clustered = m_clustered && count > 1;
+#else
+    // Without two level instancing the cells would only add a level of
+    // indirection, so the trees are always attached directly
+    if (m_clustered)
+    {
+        printf("Clustered forest instancing requires Embree with RTC_MAX_INSTANCE_LEVEL_COUNT > 1, using flat instancing\n");
+    }
+    const bool clustered = false;
+#endif
+
+    // Bucket the trees into a square grid of cells over the bounds of the
+    // frustum. About count^(1/4) cells per axis balances the number of cells
+    // in the top level scene with the number of trees in each cell.
+    int cells = clustered ? std::max((int)round(pow((double)count, 0.25)), 1) : 1;
+    std::vector<std::vector<TREE_INSTANCE>> cell_instances(cells*cells);
+
+    // Placement is abandoned on a cancel, keeping the trees
+    const int cancel_interval = 1 << 12;
     for (int i = 0; i < count; i++)
     {
-        float x = 0;
-        float y = 0;
-        float twist = 0;
-        int tree_idx = 0;
+        if (i % cancel_interval == 0 && BUILD_PROFILE::cancelled())
+        {
+            return;
+        }
+
+        TREE_INSTANCE inst = {0, 0, 0, 1, 0, 0};
         if (count > 1)
         {
             // Generate trees in a frustum
-            y = sqrt(lrand.nextf(0, 1));
-            x = lrand.nextf(-scale, scale) * y;
-            y *= 2*scale;
-            twist = lrand.nextf(0, 360.0F);
-            tree_idx = lrand.nexti() % unique_trees;
+            inst.y = sqrt(lrand.nextf(0, 1));
+            inst.x = lrand.nextf(-scale, scale) * inst.y;
+            inst.y *= 2*scale;
+            inst.twist = lrand.nextf(0, 360.0F);
+            inst.tree_idx = lrand.nexti() % unique_trees;
         }
+        inst.scale = lrand.nextf(0.5F, 2.0F);
+        inst.lod = choose_lod(inst);
 
-        RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
-        rtcSetGeometryInstancedScene(geom, tree_scenes[tree_idx]);
+        if (!clustered)
+        {
+            unsigned int id = attach_instance(scene, inst, instances.xforms);
+            instances.set_offset(id, instances.xforms.size()-1);
+            continue;
+        }
 
-        Imath::M44f xform;
-        xform.translate(Imath::V3f(x, y, 0));
-        xform.rotate(Imath::V3f(0, 0, radians(twist)));
-        xform.scale(Imath::V3f(lrand.nextf(0.5F, 2.0F)));
+        int cx = std::clamp((int)((inst.x + scale) / (2*scale) * cells), 0, cells-1);
+        int cy = std::clamp((int)(inst.y / (2*scale) * cells), 0, cells-1);
+        cell_instances[cy*cells + cx].push_back(inst);
+    }
 
-        //float xform[4][3] = {{1,0,0},{0,1,0},{0,0,1},{x,y,0}};
+    if (!clustered)
+    {
+        return;
+    }
+
+    // Build the cell scenes concurrently
+    std::vector<RTCScene> cell_scenes(cell_instances.size(), nullptr);
+    std::vector<std::vector<Imath::M44f>> cell_xforms(cell_instances.size());
+    tbb::parallel_for(0, (int)cell_instances.size(), [&](int c)
+    {
+        if (cell_instances[c].empty() || BUILD_PROFILE::cancelled())
+        {
+            return;
+        }
+
+        cell_scenes[c] = m_profile.new_scene(device);
+        for (const auto &inst : cell_instances[c])
+        {
+            attach_instance(cell_scenes[c], inst, cell_xforms[c]);
+        }
+        rtcCommitScene(cell_scenes[c]);
+
+        std::vector<TREE_INSTANCE>().swap(cell_instances[c]);
+    });
+
+    if (BUILD_PROFILE::abandoned())
+    {
+        for (RTCScene cell_scene : cell_scenes)
+        {
+            if (cell_scene)
+            {
+                rtcReleaseScene(cell_scene);
+            }
+        }
+        return;
+    }
+
+    instances.clustered = true;
+    for (int c = 0; c < (int)cell_scenes.size(); c++)
+    {
+        RTCScene cell_scene = cell_scenes[c];
+        if (!cell_scene)
+        {
+            continue;
+        }
+
+        // Cells have an identity transform, so the trees of a cell follow
+        // its offset in the transform table
+        RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_INSTANCE);
+        rtcSetGeometryInstancedScene(geom, cell_scene);
+        Imath::M44f xform;
         rtcSetGeometryTransform(geom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &xform);
         rtcCommitGeometry(geom);
 
-        rtcAttachGeometry(scene, geom);
+        unsigned int id = rtcAttachGeometry(scene, geom);
         rtcReleaseGeometry(geom);
+        rtcReleaseScene(cell_scene);
+
+        instances.set_offset(id, instances.xforms.size());
+        instances.xforms.insert(instances.xforms.end(), cell_xforms[c].begin(), cell_xforms[c].end());
     }
 }
-
@@ -16,77 +16,90 @@
 #include "ImathMatrix.h"
 #include <nlohmann/json.hpp>
 #include "shading.h"
+#include "profile.h"
 
 
-// Base class for scene nodes
-class NODE
+// Flat arena representation of a tree. Groups are stored parents first so
+// that world transforms can be resolved in a single pass, and each curve
+// owns the contiguous range of vertices up to the start of the next curve.
+struct TREE_DATA
 {
-public:
-    // c == curves, p == points
-    virtual void geometry_size(int &c, int &p) const = 0;
-    virtual void branch_geometry(const Imath::M44f &m, Imath::V4f *vertices, int &vidx, unsigned *indices, int &iidx) const = 0;
-    virtual void leaf_geometry(const Imath::M44f &m, int &idx, Imath::V4f *vertices, Imath::V3f *normals) const = 0;
-};
-
-// A transform and a list of nodes
-class GROUP_NODE : public NODE
-{
-public:
-    void add_child(NODE *n) { m_nodes.push_back(std::unique_ptr<NODE>(n)); }
-    void set_transform(const Imath::M44f &x) { m_xform = x; }
-
-    virtual void geometry_size(int &c, int &p) const override
+    // Start a new transform group, returning its index
+    int add_group(int parent)
     {
-        for (const auto &n : m_nodes)
-        {
-            n->geometry_size(c, p);
-        }
+        m_xforms.push_back(Imath::M44f());
+        m_parents.push_back(parent);
+        return m_xforms.size()-1;
     }
 
-    virtual void branch_geometry(const Imath::M44f &m, Imath::V4f *vertices, int &vidx, unsigned *indices, int &iidx) const override
+    // Start a new curve whose vertices are the ones pushed from now on
+    void add_curve(int group)
     {
-        auto xform = m_xform * m;
-        for (const auto &n : m_nodes)
-        {
-            n->branch_geometry(xform, vertices, vidx, indices, iidx);
-        }
+        m_curve_groups.push_back(group);
+        m_curve_starts.push_back(m_pos_r.size());
+        m_leaf_radii.push_back(0.01F);
     }
 
-    virtual void leaf_geometry(const Imath::M44f &m, int &idx, Imath::V4f *vertices, Imath::V3f *normals) const override
+    int curve_count() const { return m_curve_starts.size(); }
+    int point_count() const { return m_pos_r.size(); }
+    int curve_end(int c) const
     {
-        auto xform = m_xform * m;
-        for (const auto &n : m_nodes)
-        {
-            n->leaf_geometry(xform, idx, vertices, normals);
-        }
+        return c+1 < curve_count() ? m_curve_starts[c+1] : point_count();
     }
 
-    Imath::M44f m_xform;
-    std::vector<std::unique_ptr<NODE>> m_nodes;
-};
+    // Reserve space for roughly the given number of leaves
+    void reserve(int leaves);
 
-// Polygon curves
-class POLY_CURVE : public NODE
-{
-public:
-    virtual void geometry_size(int &c, int &p) const
-    {
-        c++;
-        p += m_pos_r.size();
-    }
+    // Append a subtree that was built separately. Group -1 in the subtree
+    // refers to external_group in this tree.
+    void append(const TREE_DATA &sub, int external_group);
+
+    // Per group
+    std::vector<Imath::M44f> m_xforms;
+    std::vector<int> m_parents;
+
+    // Per curve
+    std::vector<int> m_curve_groups;
+    std::vector<int> m_curve_starts;
+    std::vector<float> m_leaf_radii;
 
-    virtual void branch_geometry(const Imath::M44f &m, Imath::V4f *vertices, int &vidx, unsigned *indices, int &iidx) const override;
-    virtual void leaf_geometry(const Imath::M44f &m, int &idx, Imath::V4f *vertices, Imath::V3f *normals) const;
+    // Per vertex: position and radius
+    std::vector<Imath::V4f> m_pos_r;
+};
 
-    std::vector<std::pair<Imath::V3f, float>> m_pos_r;
-    float m_leaf_radius = 0.01F;
+// Tree parameters resolved from the scene once per build, since
+// construction reads them for every branch
+struct TREE_PARAMS
+{
+    TREE_PARAMS(const nlohmann::json &parameters);
+
+    uint32_t tree_seed;
+    float levels;
+    float tree_height;
+    float trunk_radius_ratio;
+    float leaf_area_ratio;
+    float branch_ratio;
+    float branch_ratio_variance;
+    float branch_length_exponent;
+    float da_vinci_exponent;
+    float branch_spread_angle;
+    float branch_twist_angle;
+    float branch_angle_variance;
+    bool enable_leaves;
+
+    // Construction stops at branches with this many leaves for a coarser
+    // level of detail. Not a published parameter, but may be set in the
+    // scene to fit a memory budget.
+    float lod_leaf_count;
+
+    // Hash of the parameters other than tree_seed for the geometry cache
+    uint64_t hash;
 };
 
 class TREE {
 public:
-    TREE(const nlohmann::json &parameters)
-        : m_parameters(parameters)
-        , m_root_seed(parameters["tree_seed"])
+    TREE(const TREE_PARAMS &params)
+        : m_params(params)
     {
     }
 
@@ -95,42 +108,142 @@ public:
     // Performs procedural construction of the tree
     void build();
 
-    // Generate geometry for rendering
+    // Attach previously generated geometry from the geometry cache. Returns
+    // false if it is not cached, in which case the tree must be built.
+    bool cached_geometry(RTCDevice device, RTCScene scene,
+                         std::vector<int> &shader_index,
+                         const std::vector<std::string> &shader_names) const;
+
+    // Generate geometry for rendering, saving it to the geometry cache
     void embree_geometry(RTCDevice device, RTCScene scene,
                          std::vector<int> &shader_index,
                          const std::vector<std::string> &shader_names) const;
 
+    // Approximate Embree memory in bytes from the leaf count, without
+    // building the tree
+    size_t memory_estimate(const BUILD_PROFILE &profile) const;
+
 private:
-    // Build the hierarchical representation of the tree recursively
-    void construct(GROUP_NODE& local, POLY_CURVE &trunk,
-                   float &weight, float &center_of_mass,
-                   uint32_t seed, float radius, float leaf_count);
+    uint64_t cache_key(const std::string &kind) const;
+
+    // Build the tree recursively. New groups are parented to group, and
+    // trunk vertices are appended to the last curve in data. Returns the
+    // end of the trunk vertices, which are followed by those of the side
+    // branches.
+    int construct(TREE_DATA &data, int group,
+                  float &weight, float &center_of_mass,
+                  uint32_t seed, float radius, float leaf_count) const;
+
+    // Length of the trunk curve that construct() builds at full detail,
+    // following the continuation branches without building them
+    float trunk_length(uint32_t seed, float radius, float leaf_count) const;
 
 private:
-    nlohmann::json m_parameters;
+    TREE_PARAMS m_params;
 
-    GROUP_NODE m_root;
+    TREE_DATA m_data;
 
-    uint32_t m_root_seed = 0;
     float m_leaf_radius = 1.0;
 };
 
+// Transforms of the attached forest trees, so that shading can look up a
+// hit without querying Embree
+struct FOREST_INSTANCES
+{
+    void set_offset(unsigned int id, int offset)
+    {
+        if (offsets.size() <= id)
+        {
+            offsets.resize(id+1, -1);
+        }
+        offsets[id] = offset;
+    }
+
+    // Index of the first transform of each top level instance, indexed by
+    // geometry ID or -1. The trees of a cell follow in the order of their
+    // IDs in the cell scene.
+    std::vector<int> offsets;
+    std::vector<Imath::M44f> xforms;
+
+    // Set if the top level instances are cells of trees
+    bool clustered = false;
+};
+
+// Scenes of the unique trees of a forest at each level of detail, which are
+// kept while only the camera moves
+struct FOREST_TREES
+{
+    void release()
+    {
+        for (RTCScene tree_scene : scenes)
+        {
+            rtcReleaseScene(tree_scene);
+        }
+        scenes.clear();
+    }
+
+    // Indexed by the unique tree times lod_count plus the level of detail
+    std::vector<RTCScene> scenes;
+    int lod_count = 1;
+};
+
 class FOREST {
 public:
     FOREST(const nlohmann::json &parameters)
-        : m_parameters(parameters)
+        : m_tree_params(parameters)
+        , m_forest_levels(parameters["forest_levels"])
+        , m_unique_trees(parameters["unique_trees"])
+        , m_forest_density(parameters["forest_density"])
+        , m_clustered(parameters["forest_instancing"] == "clustered")
+        , m_lod_count(parameters["forest_lod"])
+        , m_camera_pos(parameters["camera_pos"][0], parameters["camera_pos"][1], parameters["camera_pos"][2])
+        , m_camera_fov(parameters["field_of_view"])
+        , m_image_xres(parameters["res"][0])
+        , m_profile(parameters)
     {
     }
 
     static void publish_ui(nlohmann::json &json_ui);
 
-    // Generate geometry for rendering
+    // Scene parameters that the forest depends on when it has more than one
+    // level of detail
+    static const std::vector<std::string> &camera_dependencies();
+
+    // Build the scenes of the unique trees and their levels of detail,
+    // releasing any previous trees
+    void build_trees(RTCDevice device,
+                     std::vector<int> &shader_index,
+                     const std::vector<std::string> &shader_names,
+                     FOREST_TREES &trees) const;
+
+    // Attach an instance of one of the trees for each tree of the forest,
+    // at the level of detail of its size from the camera. Clustered
+    // forests attach cell instances of scenes of trees.
     void embree_geometry(RTCDevice device, RTCScene scene,
-                         std::vector<int> &shader_index,
-                         const std::vector<std::string> &shader_names) const;
+                         const FOREST_TREES &trees,
+                         FOREST_INSTANCES &instances) const;
+
+    // Approximate Embree memory in bytes of the trees and instances
+    size_t memory_estimate() const;
 
 private:
-    nlohmann::json m_parameters;
+    TREE_PARAMS m_tree_params;
+    float m_forest_levels;
+    int m_unique_trees;
+    float m_forest_density;
+
+    // Instance trees in spatial cells using two level instancing, only
+    // available when Embree is built with RTC_MAX_INSTANCE_LEVEL_COUNT > 1
+    bool m_clustered;
+
+    // Levels of detail chosen by projected size from the camera
+    int m_lod_count;
+    Imath::V3f m_camera_pos;
+    float m_camera_fov;
+    int m_image_xres;
+
+    // Build settings for the tree and cell scenes
+    BUILD_PROFILE m_profile;
 };
 
 #endif // TREE_H